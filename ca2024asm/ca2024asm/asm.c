@@ -1,262 +1,151 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <ctype.h>
 
 #include "project.h"
+#include "asmlib.h"
 
-int imem[IMEM_SIZE];
-int dmem[DMEM_SIZE];
+#define PATH_LEN 1024
 
-// registers
-int R[16];
+// the program being assembled, reused from file to file
+asm_program *prog;
 
-// files
-FILE *fp_asm, *fp_imemout, *fp_dmemout;
+// -v: print every token as it is matched
+int verbose;
 
-// opcode names
-char op_name[][10] = { "add", "sub", "and", "or", "xor", "mul", "sll", "sra", "srl", "beq", "bne", "blt", "bgt", "ble", "bge", "jal", "lw", "sw", "ll", "sc", "halt" };
-
-// register names
-char reg_name[][10] = { "$zero", "$imm", "$v0", "$a0", "$a1", "$t0", "$t1", "$t2", "$t3", "$s0", "$s1", "$s2", "$gp", "$sp", "$fp", "$ra" };
-char reg_altname[][10] = { "$zero", "$imm", "$r2", "$r3", "$r4", "$r5", "$r6", "$r7", "$r8", "$r9", "$r10", "$r11", "$r12", "$r13", "$r14", "$r15" };
-
-
-char jumplabels[IMEM_SIZE][50];
-char labels[IMEM_SIZE][50];
+static void fail(const char *path, const char *msg)
+{
+	printf("%s: ERROR: %s\n", path, msg);
+	exit(1);
+}
 
-int main(int argc, char *argv[])
+static char *read_source(const char *path, size_t *size)
 {
-	int i, last;
-	int inst, op, rd, rs, rt, imm, PC;
-	int count = 0, halt = 0;
-	char *p, *q;
-	int addr, data;
-	char line[500];
+	FILE *fp = fopen(path, "rt");
+	char *text = NULL;
+	size_t len = 0, cap = 0, got;
 
-	// check that we have 3 cmd line parameters
-	if (argc != 4) {
-		printf("usage: asm program.asm imem.txt dmem.txt\n");
+	if (!fp) {
+		printf("ERROR: couldn't open files\n");
 		exit(1);
 	}
+	do {
+		if (len == cap) {
+			cap = cap ? 2 * cap : 1 << 16;
+			text = (char *)realloc(text, cap);
+			if (!text)
+				fail(path, "out of memory");
+		}
+		got = fread(text + len, 1, cap - len, fp);
+		len += got;
+	} while (got > 0);
+	fclose(fp);
+	*size = len;
+	return text;
+}
+
+static void write_dmem(FILE *fp)
+{
+	// same image as a full DMEM_SIZE dump trimmed after the last non-zero word
+	int i, addr = 0, last = -1;
+
+	for (i = 0; i < prog->word_count; i++)
+		if (prog->words[i].data != 0)
+			last = prog->words[i].addr;
+	for (i = 0; i < prog->word_count && prog->words[i].addr <= last; i++) {
+		for (; addr < prog->words[i].addr; addr++)
+			fputs("00000000\n", fp);
+		fprintf(fp, "%08X\n", prog->words[i].data);
+		addr++;
+	}
+}
 
+static void assemble(const char *asm_name, const char *imem_name, const char *dmem_name)
+{
+	FILE *fp_imemout, *fp_dmemout;
+	size_t size;
+	char *text;
+	int i;
 
 	// open files
-	fp_asm = fopen(argv[1], "rt");
-	fp_imemout = fopen(argv[2], "wt");
-	fp_dmemout = fopen(argv[3], "wt");
-	if (!fp_asm || !fp_imemout || !fp_dmemout) {
+	text = read_source(asm_name, &size);
+	fp_imemout = fopen(imem_name, "wt");
+	fp_dmemout = fopen(dmem_name, "wt");
+	if (!fp_imemout || !fp_dmemout) {
 		printf("ERROR: couldn't open files\n");
 		exit(1);
 	}
 
-	// zero memory
-	memset(imem, 0, IMEM_SIZE * sizeof(int));
-	memset(dmem, 0, DMEM_SIZE * sizeof(int));
-
-	for (i = 0; i < IMEM_SIZE; i++) {
-		jumplabels[i][0] = 0;
-		labels[i][0] = 0;
-	}
-
-	PC = 0;
-	while (1) {
-		if (feof(fp_asm))
-			break;
-		if (fgets(line, 500, fp_asm) == NULL)
-			break;
-
-		printf("\nline: %s", line);
-
-		// remove comment
-		p = strchr(line, '#');
-		if (p != NULL)
-			*p = 0;
-
-		// get next token
-		p = strtok(line, "\t ,");
-		if (p == NULL)
-			continue;
-		printf("next token: %s\n", p);
-
-		if (strcmp(p, "") == 0)
-			continue;
-
-		// check if label
-		q = strchr(p, ':');
-		if (q != NULL) {
-			// store label
-			strcpy(labels[PC], p);
-			q = strchr(labels[PC], ':');
-			if (q == NULL) {
-				printf("ERROR matching label\n");
-				exit(1);
-			}
-			*q = 0;
-			printf("matched label %s at PC %d\n", labels[PC], PC);
-
-			// get next token
-			p = strtok(NULL, "\t ,");
-			if (p == NULL)
-				continue;
-			printf("next token: %s\n", p);
-		}
-
-		// check for .word
-		if (strcmp(p, ".word") == 0) {
-			// get next token
-			p = strtok(NULL, "\t ,");
-			if (p == NULL)
-				continue;
-			printf("next token: %s\n", p);
-			if (p[0] == '0' && p[1] == 'x')
-				sscanf(p + 2, "%x", &addr);
-			else
-				sscanf(p, "%d", &addr);
-
-			// get next token
-			p = strtok(NULL, "\t ,");
-			if (p == NULL)
-				continue;
-			printf("next token: %s\n", p);
-			if (p[0] == '0' && p[1] == 'x')
-				sscanf(p + 2, "%x", &data);
-			else
-				sscanf(p, "%d", &data);
-
-			if (addr < 0 || addr >= DMEM_SIZE) {
-				printf("ERROR: address 0x%x out of range\n", addr);
-				exit(1);
-			}
-			printf("setting dmem[0x%x] = 0x%x\n", addr, data);
-			dmem[addr] = data;
-			continue;
-		}
-					
-		// otherwise parse opcode
-		for (op = 0; op < 21; op++)
-			if (strcmp(p, op_name[op]) == 0)
-				break;
-		if (op == 21) {
-			printf("ERROR: unsupported opcode %s\n", p);
-			exit(1);
-		}
-		printf("matched opcode %d (%s)\n", op, op_name[op]);
+	prog->log = verbose ? stdout : NULL;
+	if (asm_text(prog, text, size) < 0)
+		fail(asm_name, prog->error);
+	free(text);
 
-		// parse rd
-		p = strtok(NULL, "\t ,");
-		if (p == NULL)
-			continue;
-		printf("next token: %s\n", p);
-		for (rd = 0; rd < 16; rd++) {
-			if (strcmp(p, reg_name[rd]) == 0)
-				break;
-			if (strcmp(p, reg_altname[rd]) == 0)
-				break;
-		}
-		if (rd == 16)
-			continue;
-		printf("rd: matched register %d (%s %s)\n", rd, reg_name[rd], reg_altname[rd]);
+	// print imem memory
+	for (i = 0; i < prog->imem_len; i++)
+		fprintf(fp_imemout, "%08X\n", prog->imem[i]);
 
-		// parse rs
-		p = strtok(NULL, "\t ,");
-		if (p == NULL)
-			continue;
-		printf("next token: %s\n", p);
-		for (rs = 0; rs < 16; rs++) {
-			if (strcmp(p, reg_name[rs]) == 0)
-				break;
-			if (strcmp(p, reg_altname[rs]) == 0)
-				break;
-		}
-		if (rs == 16)
-			continue;
-		printf("rs: matched register %d (%s %s)\n", rs, reg_name[rs], reg_altname[rs]);
+	// print dmem memory
+	write_dmem(fp_dmemout);
 
-		// parse rt
-		p = strtok(NULL, "\t ,");
-		if (p == NULL)
-			continue;
-		printf("next token: %s\n", p);
-		for (rt = 0; rt < 16; rt++) {
-			if (strcmp(p, reg_name[rt]) == 0)
-				break;
-			if (strcmp(p, reg_altname[rt]) == 0)
-				break;
-		}
-		if (rt == 16)
-			continue;
-		printf("rt: matched register %d (%s %s)\n", rt, reg_name[rt], reg_altname[rt]);
+	// close files
+	fclose(fp_imemout);
+	fclose(fp_dmemout);
+}
 
-		// parse imm
-		p = strtok(NULL, "\t ,");
-		if (p == NULL) {
-			// default immediate to 0 if missing (for readability in source)
-			imm = 0;
-		} else {
-			printf("next token: %s\n", p);
-			if (p[0] == '0' && p[1] == 'x')
-				sscanf(p + 2, "%x", &imm);
-			else if (isalpha(*p)) {
-				printf("saving jumplabels[%d] = %s\n", PC, p);
-				strcpy(jumplabels[PC], p);
-				q = &jumplabels[PC][0];
-				while (*q) {
-//				printf("*q == %x\n", *q);
-					if (*q == 'n' || *q == 0xd || *q == 0xa) {
-						*q = 0;
-						break;
-					}
-					q++;
-				}
-				imm = 0;
-			} else
-				sscanf(p, "%d", &imm);
-		}
-		imm = sbs(imm, 11, 0);
-		printf("imm: matched 0x%04x\n", imm);
+static void assemble_dir(const char *dir)
+{
+	// imem0.asm, imem1.asm, ... up to the first missing one, into imemN.txt and dmemN.txt
+	char asm_name[PATH_LEN], imem_name[PATH_LEN], dmem_name[PATH_LEN];
+	FILE *fp;
+	int n;
+
+	for (n = 0;; n++) {
+		snprintf(asm_name, PATH_LEN, "%s/imem%d.asm", dir, n);
+		fp = fopen(asm_name, "rt");
+		if (!fp)
+			break;
+		fclose(fp);
+		snprintf(imem_name, PATH_LEN, "%s/imem%d.txt", dir, n);
+		snprintf(dmem_name, PATH_LEN, "%s/dmem%d.txt", dir, n);
+		assemble(asm_name, imem_name, dmem_name);
+	}
+	if (n == 0) {
+		printf("ERROR: no imem0.asm in %s\n", dir);
+		exit(1);
+	}
+}
 
-		inst = (op << 24) | (rd << 20) | (rs << 16) | (rt << 12) | imm;
-		printf("--> inst is mem[%d] = %08X\n", PC, inst);
-		imem[PC++] = inst;
+int main(int argc, char *argv[])
+{
+	int i, first = 1;
 
+	if (argc > 1 && strcmp(argv[1], "-v") == 0) {
+		verbose = 1;
+		first = 2;
 	}
-	// fix labels
-	for (PC = 0; PC < IMEM_SIZE; PC++) {
-		if (jumplabels[PC][0] != 0) {
-			for (i = 0; i < IMEM_SIZE; i++) {
-//				printf("PC %d, i %d, jumplables[PC] %s (length %d), labels[i] %s (length %d)\n", PC, i, jumplabels[PC], strlen(jumplabels[PC]), labels[i], strlen(labels[i]));
-				if (strcmp(jumplabels[PC], labels[i]) == 0) {
-					printf("matched label %s from PC 0x%x to 0x%x\n", labels[i], PC, i);
-					imem[PC] |= i;
-					break;
-				}
-			}
-			if (i == IMEM_SIZE) {
-				printf("ERROR: couldn't find label %s referenced at PC %d\n", jumplabels[PC], PC);
-				exit(1);
-			}
-		}
+
+	prog = asm_alloc();
+	if (!prog) {
+		printf("ERROR: out of memory\n");
+		exit(1);
 	}
 
-	// print imem memory
-	last = IMEM_SIZE - 1;
-	while (last >= 0 && imem[last] == 0)
-		last--;
-	for (i = 0; i <= last; i++)
-		fprintf(fp_imemout, "%08X\n", imem[i]);
+	if (argc - first >= 2 && strcmp(argv[first], "-batch") == 0) {
+		for (i = first + 1; i < argc; i++)
+			assemble_dir(argv[i]);
+		asm_free(prog);
+		return 0;
+	}
 
-	// print dmem memory
-	last = DMEM_SIZE - 1;
-	while (last >= 0 && dmem[last] == 0)
-		last--;
-	for (i = 0; i <= last; i++)
-		fprintf(fp_dmemout, "%08X\n", dmem[i]);
+	// check that we have 3 cmd line parameters
+	if (argc - first != 3) {
+		printf("usage: asm [-v] program.asm imem.txt dmem.txt\n");
+		printf("       asm [-v] -batch dir [dir ...]\n");
+		exit(1);
+	}
+	assemble(argv[first], argv[first + 1], argv[first + 2]);
+	asm_free(prog);
 
-	// close files
-	fclose(fp_asm);
-	fclose(fp_imemout);
-	fclose(fp_dmemout);
-	
 	return 0;
 }
@@ -0,0 +1,415 @@
+// Assembler core shared by the ca2024asm command-line tool and the simulator (which assembles .asm inputs in memory).
+// Header only, like tracefmt.h; all state lives in an asm_program, so several can be in use on different threads.
+#ifndef ASMLIB_H
+#define ASMLIB_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <stdarg.h>
+
+#define ASM_IMEM_SIZE (1 << 10)
+#define ASM_DMEM_SIZE (1 << 20)
+#define ASM_LINE_LEN 500	// longer lines are split, as fgets into a 500-byte buffer did
+#define ASM_LABEL_LEN 50
+#define ASM_SYMTAB_SIZE (4 * ASM_IMEM_SIZE)	// open addressing, power of two
+#define ASM_OPCODES 25
+#define ASM_ERROR_LEN 256
+
+// token separators; line ends too, so the last operand of a line never carries the newline
+#define ASM_DELIMS "\t ,\r\n"
+
+// .word data, kept sparse as (address, value) pairs
+typedef struct {
+	int addr;
+	int data;
+	int seq;
+} asm_word;
+
+// labels are hashed by name, each with the list of instructions still waiting for its address
+typedef struct {
+	char name[ASM_LABEL_LEN];
+	int pc;		// -1 while the label is only referenced
+	int fixups;	// first waiting PC, chained through fixup_next[]
+} asm_symbol;
+
+typedef struct {
+	int imem[ASM_IMEM_SIZE];
+	int pc;			// next instruction address
+	int imem_len;		// after asm_finish: instructions up to the last non-zero word
+	asm_word *words;	// after asm_finish: sorted by address, one entry (the last write) per address
+	int word_count, word_cap;
+	asm_symbol symtab[ASM_SYMTAB_SIZE];
+	int symtab_slots[ASM_SYMTAB_SIZE];	// occupied slots, cleared by asm_reset
+	int symtab_count;
+	int fixup_next[ASM_IMEM_SIZE];
+	int ref_symbol[ASM_IMEM_SIZE];	// slot referenced by the immediate at each PC, or -1
+	int src_line[ASM_IMEM_SIZE];	// source line (1-based) of each instruction
+	int line;		// line asm_text is on
+	int imm;		// kept from line to line, as before, when an immediate does not parse
+	FILE *log;		// token trace (asm -v), NULL = quiet
+	char error[ASM_ERROR_LEN];
+} asm_program;
+
+static const char asm_op_name[ASM_OPCODES][10] = { "add", "sub", "and", "or", "xor", "mul", "sll", "sra", "srl", "beq", "bne", "blt", "bgt", "ble", "bge", "jal", "lw", "sw", "ll", "sc", "halt", "mac", "lwpi", "vlw", "vsw" };
+
+static const char asm_reg_name[16][10] = { "$zero", "$imm", "$v0", "$a0", "$a1", "$t0", "$t1", "$t2", "$t3", "$s0", "$s1", "$s2", "$gp", "$sp", "$fp", "$ra" };
+static const char asm_reg_altname[16][10] = { "$zero", "$imm", "$r2", "$r3", "$r4", "$r5", "$r6", "$r7", "$r8", "$r9", "$r10", "$r11", "$r12", "$r13", "$r14", "$r15" };
+
+static inline void asm_trace(asm_program *a, const char *fmt, ...)
+{
+	va_list ap;
+
+	if (!a->log)
+		return;
+	va_start(ap, fmt);
+	vfprintf(a->log, fmt, ap);
+	va_end(ap);
+}
+
+static inline int asm_fail(asm_program *a, const char *fmt, ...)
+{
+	va_list ap;
+
+	va_start(ap, fmt);
+	vsnprintf(a->error, ASM_ERROR_LEN, fmt, ap);
+	va_end(ap);
+	return -1;
+}
+
+static inline void asm_reset(asm_program *a)
+{
+	int i;
+
+	memset(a->imem, 0, sizeof(a->imem));
+	a->pc = 0;
+	a->imem_len = 0;
+	a->word_count = 0;
+	for (i = 0; i < a->symtab_count; i++)
+		a->symtab[a->symtab_slots[i]].name[0] = 0;
+	a->symtab_count = 0;
+	for (i = 0; i < ASM_IMEM_SIZE; i++)
+		a->ref_symbol[i] = -1;
+	a->imm = 0;
+	a->line = 1;
+	a->error[0] = 0;
+}
+
+static inline asm_program *asm_alloc(void)
+{
+	asm_program *a = (asm_program *)calloc(1, sizeof(asm_program));
+
+	if (a)
+		asm_reset(a);
+	return a;
+}
+
+static inline void asm_free(asm_program *a)
+{
+	if (!a)
+		return;
+	free(a->words);
+	free(a);
+}
+
+static inline asm_symbol *asm_find_symbol(asm_program *a, const char *name)
+{
+	// NULL (with a->error set) when the label cannot be added
+	unsigned int h = 2166136261u;	// FNV-1a
+	const char *p;
+	int slot;
+
+	for (p = name; *p; p++)
+		h = (h ^ (unsigned char)*p) * 16777619u;
+	slot = h & (ASM_SYMTAB_SIZE - 1);
+	while (a->symtab[slot].name[0] != 0) {
+		if (strcmp(a->symtab[slot].name, name) == 0)
+			return &a->symtab[slot];
+		slot = (slot + 1) & (ASM_SYMTAB_SIZE - 1);
+	}
+	if (a->symtab_count >= ASM_SYMTAB_SIZE / 2) {
+		asm_fail(a, "too many labels");
+		return NULL;
+	}
+	if (strlen(name) >= ASM_LABEL_LEN) {
+		asm_fail(a, "label %s longer than %d characters", name, ASM_LABEL_LEN - 1);
+		return NULL;
+	}
+	strcpy(a->symtab[slot].name, name);
+	a->symtab[slot].pc = -1;
+	a->symtab[slot].fixups = -1;
+	a->symtab_slots[a->symtab_count++] = slot;
+	return &a->symtab[slot];
+}
+
+static inline int asm_define_label(asm_program *a, const char *name)
+{
+	asm_symbol *s = asm_find_symbol(a, name);
+	int f;
+
+	if (!s)
+		return -1;
+	// the first definition wins, as with the old first-match search
+	if (s->pc >= 0)
+		return 0;
+	s->pc = a->pc;
+	asm_trace(a, "matched label %s at PC %d\n", name, a->pc);
+	for (f = s->fixups; f >= 0; f = a->fixup_next[f]) {
+		asm_trace(a, "matched label %s from PC 0x%x to 0x%x\n", name, f, a->pc);
+		a->imem[f] |= a->pc;
+	}
+	s->fixups = -1;
+	return 0;
+}
+
+static inline int asm_reference_label(asm_program *a, const char *name)
+{
+	// sets a->imm now; forward references are patched when the label shows up
+	asm_symbol *s = asm_find_symbol(a, name);
+
+	if (!s)
+		return -1;
+	a->ref_symbol[a->pc] = (int)(s - a->symtab);
+	if (s->pc >= 0) {
+		a->imm = s->pc;
+		return 0;
+	}
+	a->fixup_next[a->pc] = s->fixups;
+	s->fixups = a->pc;
+	a->imm = 0;
+	return 0;
+}
+
+static inline int asm_parse_reg(const char *p)
+{
+	int r;
+
+	for (r = 0; r < 16; r++) {
+		if (strcmp(p, asm_reg_name[r]) == 0)
+			break;
+		if (strcmp(p, asm_reg_altname[r]) == 0)
+			break;
+	}
+	return r;
+}
+
+static inline int asm_add_word(asm_program *a, int addr, int data)
+{
+	if (a->word_count == a->word_cap) {
+		int cap = a->word_cap ? 2 * a->word_cap : 256;
+		asm_word *words = (asm_word *)realloc(a->words, cap * sizeof(asm_word));
+		if (!words)
+			return asm_fail(a, "out of memory");
+		a->words = words;
+		a->word_cap = cap;
+	}
+	a->words[a->word_count].addr = addr;
+	a->words[a->word_count].data = data;
+	a->words[a->word_count].seq = a->word_count;
+	a->word_count++;
+	return 0;
+}
+
+static inline char *asm_token(char **cursor)
+{
+	// strtok(NULL, ASM_DELIMS) with the position held by the caller, not in strtok's static, so threads never share it
+	char *p = *cursor + strspn(*cursor, ASM_DELIMS);
+	char *end;
+
+	if (*p == 0) {
+		*cursor = p;
+		return NULL;
+	}
+	end = p + strcspn(p, ASM_DELIMS);
+	if (*end)
+		*end++ = 0;
+	*cursor = end;
+	return p;
+}
+
+static inline int asm_line(asm_program *a, char *line)
+{
+	// one source line (modified in place); 0, or -1 with a->error set
+	int op, rd, rs, rt, inst;
+	int addr = 0, data = 0;
+	char *p, *q, *cursor = line;
+
+	asm_trace(a, "\nline: %s", line);
+
+	// remove comment
+	p = strchr(line, '#');
+	if (p != NULL)
+		*p = 0;
+
+	// get next token
+	p = asm_token(&cursor);
+	if (p == NULL)
+		return 0;
+	asm_trace(a, "next token: %s\n", p);
+
+	// check if label
+	q = strchr(p, ':');
+	if (q != NULL) {
+		*q = 0;
+		if (asm_define_label(a, p) < 0)
+			return -1;
+
+		// get next token
+		p = asm_token(&cursor);
+		if (p == NULL)
+			return 0;
+		asm_trace(a, "next token: %s\n", p);
+	}
+
+	// check for .word
+	if (strcmp(p, ".word") == 0) {
+		// get next token
+		p = asm_token(&cursor);
+		if (p == NULL)
+			return 0;
+		asm_trace(a, "next token: %s\n", p);
+		if (p[0] == '0' && p[1] == 'x')
+			sscanf(p + 2, "%x", &addr);
+		else
+			sscanf(p, "%d", &addr);
+
+		// get next token
+		p = asm_token(&cursor);
+		if (p == NULL)
+			return 0;
+		asm_trace(a, "next token: %s\n", p);
+		if (p[0] == '0' && p[1] == 'x')
+			sscanf(p + 2, "%x", &data);
+		else
+			sscanf(p, "%d", &data);
+
+		if (addr < 0 || addr >= ASM_DMEM_SIZE)
+			return asm_fail(a, "address 0x%x out of range", addr);
+		asm_trace(a, "setting dmem[0x%x] = 0x%x\n", addr, data);
+		return asm_add_word(a, addr, data);
+	}
+
+	// otherwise parse opcode
+	for (op = 0; op < ASM_OPCODES; op++)
+		if (strcmp(p, asm_op_name[op]) == 0)
+			break;
+	if (op == ASM_OPCODES)
+		return asm_fail(a, "unsupported opcode %s", p);
+	asm_trace(a, "matched opcode %d (%s)\n", op, asm_op_name[op]);
+
+	// parse rd, rs and rt; a line with a missing or unknown register is skipped
+	p = asm_token(&cursor);
+	if (p == NULL)
+		return 0;
+	asm_trace(a, "next token: %s\n", p);
+	rd = asm_parse_reg(p);
+	if (rd == 16)
+		return 0;
+	asm_trace(a, "rd: matched register %d (%s %s)\n", rd, asm_reg_name[rd], asm_reg_altname[rd]);
+
+	p = asm_token(&cursor);
+	if (p == NULL)
+		return 0;
+	asm_trace(a, "next token: %s\n", p);
+	rs = asm_parse_reg(p);
+	if (rs == 16)
+		return 0;
+	asm_trace(a, "rs: matched register %d (%s %s)\n", rs, asm_reg_name[rs], asm_reg_altname[rs]);
+
+	p = asm_token(&cursor);
+	if (p == NULL)
+		return 0;
+	asm_trace(a, "next token: %s\n", p);
+	rt = asm_parse_reg(p);
+	if (rt == 16)
+		return 0;
+	asm_trace(a, "rt: matched register %d (%s %s)\n", rt, asm_reg_name[rt], asm_reg_altname[rt]);
+
+	if (a->pc == ASM_IMEM_SIZE)
+		return asm_fail(a, "program longer than %d instructions", ASM_IMEM_SIZE);
+
+	// parse imm
+	p = asm_token(&cursor);
+	if (p == NULL) {
+		// default immediate to 0 if missing (for readability in source)
+		a->imm = 0;
+	} else {
+		asm_trace(a, "next token: %s\n", p);
+		if (p[0] == '0' && p[1] == 'x')
+			sscanf(p + 2, "%x", &a->imm);
+		else if (isalpha((unsigned char)*p)) {
+			asm_trace(a, "saving label reference %s at PC %d\n", p, a->pc);
+			if (asm_reference_label(a, p) < 0)
+				return -1;
+		} else
+			sscanf(p, "%d", &a->imm);
+	}
+	a->imm &= 0xFFF;
+	asm_trace(a, "imm: matched 0x%04x\n", a->imm);
+
+	inst = (op << 24) | (rd << 20) | (rs << 16) | (rt << 12) | a->imm;
+	asm_trace(a, "--> inst is mem[%d] = %08X\n", a->pc, inst);
+	a->src_line[a->pc] = a->line;
+	a->imem[a->pc++] = inst;
+	return 0;
+}
+
+static inline int asm_word_order(const void *x, const void *y)
+{
+	const asm_word *u = (const asm_word *)x, *v = (const asm_word *)y;
+
+	if (u->addr != v->addr)
+		return u->addr < v->addr ? -1 : 1;
+	return u->seq - v->seq;
+}
+
+static inline int asm_finish(asm_program *a)
+{
+	// checks that every label reference resolved, trims imem and sorts the data words
+	int i, n = 0;
+
+	for (i = 0; i < a->pc; i++)
+		if (a->ref_symbol[i] >= 0 && a->symtab[a->ref_symbol[i]].pc < 0)
+			return asm_fail(a, "couldn't find label %s referenced at PC %d", a->symtab[a->ref_symbol[i]].name, i);
+
+	a->imem_len = ASM_IMEM_SIZE;
+	while (a->imem_len > 0 && a->imem[a->imem_len - 1] == 0)
+		a->imem_len--;
+
+	if (a->word_count > 0)
+		qsort(a->words, a->word_count, sizeof(asm_word), asm_word_order);
+	// keep the last write to each address
+	for (i = 0; i < a->word_count; i++) {
+		if (n > 0 && a->words[n - 1].addr == a->words[i].addr)
+			n--;
+		a->words[n++] = a->words[i];
+	}
+	a->word_count = n;
+	return 0;
+}
+
+static inline int asm_text(asm_program *a, const char *text, size_t size)
+{
+	// assembles a whole source held in memory; 0, or -1 with a->error set
+	char line[ASM_LINE_LEN];
+	size_t pos = 0, len;
+	int eol;
+
+	asm_reset(a);
+	while (pos < size) {
+		len = 0;
+		eol = 0;
+		while (pos < size && len < ASM_LINE_LEN - 1 && !eol) {
+			line[len++] = text[pos];
+			eol = text[pos++] == '\n';
+		}
+		line[len] = 0;
+		if (asm_line(a, line) < 0)
+			return -1;
+		a->line += eol;
+	}
+	return asm_finish(a);
+}
+
+#endif
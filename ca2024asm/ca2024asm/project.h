@@ -17,7 +17,13 @@
 #define OP_JAL 15
 #define OP_LW  16
 #define OP_SW  17
+#define OP_LL  18
+#define OP_SC  19
 #define OP_HALT 20
+#define OP_MAC 21
+#define OP_LWPI 22
+#define OP_VLW 23
+#define OP_VSW 24
 
 // instruction memory
 #define IMEM_SIZE (1 << 10)
@@ -1,28 +1,77 @@
-// Simulator for 4 pipelined cores with private caches and MESI snooping bus.
-// Implements 5-stage pipeline with decode-based hazard stalls and delay-slot branches.
-// Caches are direct mapped, write-back, write-allocate; bus is single transaction per cycle with round-robin arbitration.
+// Simulator for N pipelined cores (4 by default) with private caches and MESI snooping bus.
+// Implements 5-stage pipeline with decode-based hazard stalls (or optional operand forwarding) and delay-slot branches.
+// Caches are direct mapped by default (optionally N-way set associative), write-back, write-allocate;
+// bus is single transaction per cycle with round-robin arbitration.
+// Core count, cache geometry and memory latency are set per run with command-line flags (see MachineConfig).
+#ifndef _WIN32
+#define _POSIX_C_SOURCE 200809L // mmap
+#endif
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
 #include <stdbool.h>
 #include <string.h>
+#include <limits.h>
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#include <malloc.h>
+#else
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+#include "tracefmt.h"
+#include "ca2024asm/ca2024asm/asmlib.h"
+
+// Rare paths kept out of core_step's hot loop, and per-core state that starts on its own cache line
+#define CACHE_LINE 64
+#if defined(__GNUC__)
+#define NOINLINE __attribute__((noinline))
+#define CACHE_ALIGNED __attribute__((aligned(CACHE_LINE)))
+#else
+#define NOINLINE
+#define CACHE_ALIGNED
+#endif
 
 // Architecture constants
-#define NUM_CORES 4
+#define MAX_CORES 32
 #define REG_COUNT 16
 #define IMEM_SIZE 1024
 #define MAIN_MEM_WORDS (1 << 20)
+#define MEM_PAGE_WORDS 1024 // 4 KB pages of 128 blocks, allocated on first non-zero write
+#define MEM_PAGES (MAIN_MEM_WORDS / MEM_PAGE_WORDS)
+
+// Default machine (the original 4-core configuration) and geometry limits
+#define DEFAULT_CORES 4
+#define DEFAULT_CACHE_LINES 64
+#define DEFAULT_BLOCK_WORDS 8
+#define DEFAULT_MEM_DELAY 16
+#define DEFAULT_L2_WAYS 8
+#define DEFAULT_L2_DELAY 4
+#define MAX_BLOCK_WORDS 64 // a block never spans a memory page
+#define MAX_WAYS 32        // pseudo-LRU tree bits of a set fit one word
+#define MAX_BUS_QUEUE 16   // outstanding transactions at the memory controller (split bus)
+#define MAX_STORE_BUFFER 16
+#define PREFETCH_QUEUE 4   // candidate blocks waiting for an idle bus, per core
+#define PREFETCH_TABLE 16  // stride detector entries, indexed by load/store PC
+#define ADDR_BITS 20
+#define NO_BLOCK 0xFFFFFFFFu // not a block address
+
+// Trace output buffer per trace file, and ring of raw rows per file when a writer thread formats them
+#define TRACE_BUFFER_BYTES (1 << 20)
+#define TRACE_RING_ROWS (1 << 14)
 
-// Cache parameters
-#define CACHE_WORDS 512
-#define CACHE_LINES 64
-#define BLOCK_WORDS 8
-#define OFFSET_BITS 3
-#define INDEX_BITS 6
-#define TAG_BITS (20 - OFFSET_BITS - INDEX_BITS)
-#define INDEX_MASK ((1 << INDEX_BITS) - 1)
-#define OFFSET_MASK ((1 << OFFSET_BITS) - 1)
-#define TAG_MASK ((1 << TAG_BITS) - 1)
+// Cycles per bus utilization window when SIM_BUS_STATS does not give one
+#define BUS_WINDOW_DEFAULT 1000
+
+// Helper threads formatting the end-of-run dumps (memout, regout, dsram, tsram, stats) with the caller
+#define DUMP_THREADS_MAX 3
 
 // Bus command values
 #define BUS_NONE 0
@@ -30,11 +79,27 @@
 #define BUS_RDX 2
 #define BUS_FLUSH 3
 
+// Replacement policies for set-associative caches
+#define REPL_LRU 0
+#define REPL_PLRU 1
+#define REPL_RANDOM 2
+
+// Prefetch policies
+#define PREFETCH_NONE 0
+#define PREFETCH_NEXT 1   // next block after a miss or a first hit on a prefetched line
+#define PREFETCH_STRIDE 2 // per-PC constant stride
+
+// Bus request sources within a core
+#define REQ_MEM 0          // MEM stage miss or upgrade
+#define REQ_STORE_BUFFER 1 // store buffer drain
+#define REQ_PREFETCH 2     // hardware prefetch, granted only when no demand request is waiting
+
 // MESI states
 #define MESI_I 0
 #define MESI_S 1
 #define MESI_E 2
 #define MESI_M 3
+#define L2_VALID 1 // L2 lines are valid or invalid; coherence state lives in the private caches
 
 // Opcodes
 enum {
@@ -56,17 +121,68 @@ enum {
     OP_JAL,
     OP_LW,
     OP_SW,
-    OP_HALT = 20
+    OP_LL, // load linked: lw that also sets the reservation on the block
+    OP_SC, // store conditional: sw only while the reservation holds; rd = 1 if it stored, 0 if not
+    OP_HALT = 20,
+    OP_MAC,  // rd += rs * rt
+    OP_LWPI, // lw with post-increment: rd = MEM[rs], then rs += rt
+    OP_VLW,  // 4-lane vector load: rd..rd+3 = MEM[a..a+3], a = (rs + rt) aligned down to 4 words
+    OP_VSW   // 4-lane vector store: MEM[a..a+3] = rd..rd+3
+};
+
+#define VEC_LANES 4
+
+// Handlers pre-bound to each predecoded instruction: the EXEC result (alu_ops) and the functional
+// engine's instruction class (functional_ops). Common $zero/$imm forms get their own ALU handlers.
+enum {
+    ALU_NONE = 0, // no result (branches, lw/sw, halt, unknown opcodes)
+    ALU_ADD,
+    ALU_SUB,
+    ALU_AND,
+    ALU_OR,
+    ALU_XOR,
+    ALU_MUL,
+    ALU_SLL,
+    ALU_SRA,
+    ALU_SRL,
+    ALU_JAL,
+    ALU_IMM,     // add/or rd, $zero, $imm: load immediate
+    ALU_ADD_IMM, // add rd, rs, $imm
+    ALU_MOVE,    // add/or rd, rs, $zero
+    ALU_MAC,
+    ALU_HANDLERS
+};
+
+enum {
+    KIND_ALU = 0,
+    KIND_BRANCH,
+    KIND_JAL,
+    KIND_LW,
+    KIND_SW,
+    KIND_LL,
+    KIND_SC,
+    KIND_LWPI,
+    KIND_VLW,
+    KIND_VSW,
+    KIND_HALT,
+    KIND_HANDLERS
 };
 
 typedef struct {
+    // Predecoded instruction word; hazard masks hold one bit per architectural register (R2-R15 only)
     uint32_t raw;
-    int op;
-    int rd;
-    int rs;
-    int rt;
     int32_t imm;
-    int pc;
+    uint16_t pc;
+    uint16_t src_mask; // registers read by decode/exec
+    uint16_t dst_mask; // registers written at WB, 0 if none
+    uint8_t op;
+    uint8_t rd;
+    uint8_t rs;
+    uint8_t rt;
+    int8_t dst;        // destination register index, or -1 if none (vlw writes its lanes from dst_mask)
+    int8_t dst2;       // lwpi: the base register it advances, or -1
+    uint8_t alu;       // ALU_* handler
+    uint8_t kind;      // KIND_* handler
 } Instruction;
 
 typedef struct {
@@ -98,22 +214,108 @@ typedef struct {
     bool miss;
     bool waiting;
     bool request_queued;
+    bool word_ready; // critical-word-first: the load's word arrived on the bus ahead of the rest of the block
     uint32_t load_value;
+    // vlw/vsw: alu_result holds lane 0's address and mem_addr the lane being fetched; lanes that hit are done
+    uint8_t lanes_done;
+    uint32_t lanes[VEC_LANES]; // vlw: loaded words, vsw: store data
 } MemStage;
 
 typedef struct {
     bool valid;
     Instruction inst;
     uint32_t value;
+    uint32_t value2;           // lwpi: the advanced base
+    uint32_t lanes[VEC_LANES]; // vlw
 } WbStage;
 
 typedef struct {
-    // DSRAM: data words; TSRAM represented separately by tag/state arrays
-    uint32_t data[CACHE_WORDS];
-    uint16_t tag[CACHE_LINES];
-    uint8_t state[CACHE_LINES];
+    // One set of pipeline registers. A core keeps two: PIPE(c) is the one latched at the start of this cycle,
+    // core_step builds the next cycle's in the other and then flips, so no latch is copied back.
+    FetchStage fetch;
+    DecodeStage decode;
+    ExecStage exec;
+    MemStage mem;
+    WbStage wb;
+} Latches;
+
+typedef struct {
+    // Machine shape from the command line; fixed for the lifetime of a Simulator
+    int num_cores;   // -cores, 1..MAX_CORES
+    int cache_lines; // -lines, power of two
+    int block_words; // -block, power of two up to MAX_BLOCK_WORDS
+    int mem_delay;   // -delay, memory latency in cycles before the first flush beat
+    int ways;        // -ways, power of two up to MAX_WAYS; 1 = direct mapped
+    int policy;      // -policy lru|plru|random (REPL_*)
+    int bus_queue;   // -bus-queue, 0 = atomic bus, else split-transaction bus with this many outstanding
+    bool critical_word_first; // -cwf: flush the requested word first and restart the waiting lw on it
+    bool forwarding;          // -forward: bypass results to EXEC, load-use interlock only
+    int store_buffer;         // -store-buffer, entries per core; 0 = stores block in MEM
+    int prefetch;             // -prefetch none|next|stride (PREFETCH_*)
+    bool snoop_filter;        // -snoop-filter: probe only the caches a sharer vector says may hold the block
+    int l2_lines;             // -l2, lines of the shared inclusive L2; 0 = no L2
+    int l2_ways;              // -l2-ways, power of two up to MAX_WAYS
+    int l2_delay;             // -l2-delay, cycles before the first flush beat of a block the L2 supplies
+} MachineConfig;
+
+typedef struct {
+    // Power-of-two sizes, so index/tag/offset stay shift-and-mask with precomputed amounts
+    int lines; // total lines, sets * ways
+    int ways;
+    int way_bits;
+    int block_words;
+    int offset_bits;
+    int tag_shift; // offset bits + set index bits
+    uint32_t offset_mask;
+    uint32_t index_mask;
+    uint32_t tag_mask;
+    int policy;
+} CacheGeometry;
+
+typedef struct {
+    // DSRAM: data words; TSRAM represented separately by tag/state arrays (storage owned by the Simulator).
+    // Line slot = set * ways + way, so the tags and states of one set are adjacent.
+    CacheGeometry geo;
+    uint32_t *data;  // lines * block_words
+    uint32_t *tag;   // lines
+    uint32_t *repl;  // LRU: last-use stamp per line; PLRU: tree bits per set
+    uint8_t *state;  // lines
+    uint8_t *prefetched; // lines; set by a prefetch fill until the first demand access
+    uint32_t clock;  // LRU stamp source
+    uint32_t rng;    // random replacement, xorshift32 seeded per core
+    // ll/sc reservation: set by ll; cleared by sc, by another core's BUS_RDX to the block and by its eviction
+    bool reserved;
+    uint32_t reserved_block;
 } Cache;
 
+typedef union {
+    CoreTraceRow core;
+    BusTraceRow bus;
+} TraceRow;
+
+typedef struct {
+    // Single-producer/single-consumer queue of raw rows; head written by the simulation, tail by the writer
+    volatile uint32_t head;
+    volatile uint32_t tail;
+    TraceRow rows[TRACE_RING_ROWS];
+} TraceRing;
+
+typedef struct {
+    // Buffered trace file; text lines or binary records (see tracefmt.h)
+    FILE *fp;
+    bool binary;
+    int kind;
+    uint8_t *buf;
+    size_t len;
+    uint32_t last_regs[TRACE_REGS]; // binary mode: register values as of the previous core row
+    TraceRing *ring;                // set while a TraceWriter owns formatting for this file
+    int from;  // first cycle written; INT_MAX while disabled or waiting for a trigger
+    int until; // last cycle written
+    TraceRow *recorder;      // flight recorder: the newest recorder_rows rows, written when the run ends
+    uint32_t recorder_rows;
+    uint32_t recorded;       // rows pushed into the recorder so far
+} TraceOut;
+
 typedef struct {
     // Stats counters collected per core and dumped to stats?.txt
     uint32_t cycles;
@@ -124,43 +326,198 @@ typedef struct {
     uint32_t write_miss;
     uint32_t decode_stall;
     uint32_t mem_stall;
+    // critical-word-first only (-cwf)
+    uint32_t early_restart; // load misses retired on their first flush beat
+    uint32_t fill_stall;    // MEM cycles stalled on the line still being filled
+    // forwarding only (-forward)
+    uint32_t forwarded;      // source operands bypassed instead of stalling decode
+    uint32_t load_use_stall; // EXEC cycles held for a load still in MEM
+    // store buffer only (-store-buffer)
+    uint32_t sb_forward;    // loads served from a buffered store
+    uint32_t sb_full_stall; // MEM cycles a sw waited for a free entry
+    // prefetcher only (-prefetch)
+    uint32_t prefetch_issued; // prefetch reads sent to the bus
+    uint32_t prefetch_useful; // prefetched lines later hit by a demand access
+    uint32_t prefetch_late;   // demand misses on a block whose prefetch was still in flight
+    // snoop filter only (-snoop-filter), counted for the requesting core
+    uint32_t snoop_probes;   // peer caches probed for this core's transactions
+    uint32_t snoop_filtered; // peer caches skipped because the sharer vector excluded them
+    // ll/sc, written once the program ran an sc
+    uint32_t sc_success; // sc that stored
+    uint32_t sc_fail;    // sc that found the reservation gone and stored nothing
+    // sampled simulation only (SIM_SAMPLE)
+    uint32_t functional_instructions; // executed by the functional engine, not the pipeline
+    uint32_t sample_cycles;           // cycles inside measured detailed windows
+    uint32_t sample_instructions;     // instructions retired inside measured detailed windows
 } Stats;
 
+// Stage holding the in-flight writer a stalled decode waits on; BUSY when decode only waits for EXEC to free up
+enum {
+    STALL_EXEC,
+    STALL_MEM,
+    STALL_WB,
+    STALL_BUSY,
+    STALL_KINDS
+};
+
+typedef struct {
+    // Per-PC counters of the profiler (SIM_PROFILE), charged to the instruction that stalled, missed or retired
+    uint32_t retired;
+    uint32_t decode_stall[STALL_KINDS];
+    uint32_t load_use_stall;
+    uint32_t mem_stall;
+    uint32_t read_miss;
+    uint32_t write_miss;
+} ProfileRow;
+
+typedef struct {
+    uint32_t addr;
+    uint32_t data;
+    uint16_t pc;  // the sw, for the profiler
+    bool counted; // write hit/miss already recorded
+} StoreEntry;
+
+typedef struct {
+    // FIFO of retired stores, drained into the cache one per cycle in program order
+    StoreEntry entries[MAX_STORE_BUFFER];
+    int head;
+    int count;
+    bool pending; // head entry's BUS_RDX is outstanding
+} StoreBuffer;
+
+typedef struct {
+    uint16_t pc;
+    bool valid;
+    uint8_t confidence;
+    uint32_t last_addr;
+    int32_t stride;
+} StrideEntry;
+
 typedef struct {
+    // Candidate block addresses (oldest first), at most one prefetch on the bus at a time
+    uint32_t queue[PREFETCH_QUEUE];
+    int count;
+    bool inflight;
+    uint32_t inflight_block;
+    StrideEntry table[PREFETCH_TABLE];
+} Prefetcher;
+
+typedef struct {
+    // What core_step touches every cycle comes first, from a cache-line boundary (see sim_alloc); the program
+    // images, read once per fetch or only at load time, come last
+    uint32_t regs[REG_COUNT] CACHE_ALIGNED;
+    Latches latch[2]; // pipeline registers, double buffered (see PIPE)
+    int cur;          // index of this cycle's set in latch[]
     int id;
-    uint32_t imem[IMEM_SIZE];
-    uint32_t regs[REG_COUNT];
     int pc;
     bool redirect_pending;
     int redirect_pc;
     bool stop_fetch;
     bool halted;
     bool done;
-    FetchStage fetch;
-    DecodeStage decode;
-    ExecStage exec;
-    MemStage mem;
-    WbStage wb;
+    bool drain; // sampled simulation: fetch paused so the pipeline empties before a functional phase
+    bool fill_pending;   // critical-word-first: a restarted load's block is still streaming in
+    uint32_t fill_block; // its block base address
     Cache cache;
     Stats stats;
-    FILE *trace_fp;
+    StoreBuffer sb;
+    Prefetcher pf;
+    TraceOut trace;
+    Instruction prog[IMEM_SIZE]; // imem predecoded once at load time
+    uint32_t imem[IMEM_SIZE];
 } Core;
 
+// The pipeline registers core c latched at the start of the current cycle
+#define PIPE(c) (&(c)->latch[(c)->cur])
+
+// Sampled simulation: the functional engine's translation of one instruction. imem never changes during a run, so
+// each core's program is translated once into IMEM_SIZE of these, and the superblock entered at any PC is the
+// straight run of ops from there (see superblock_translate). The operands are resolved: R0 and R1 read as R0 plus
+// the constant, so $imm needs no register write and ops with constant inputs are folded to SB_SET.
+enum {
+    SB_NOP,
+    SB_SET, // R[dst] = ka
+    SB_ADD, SB_SUB, SB_AND, SB_OR, SB_XOR, SB_MUL, SB_SLL, SB_SRA, SB_SRL,
+    SB_MAC,
+    SB_BEQ, SB_BNE, SB_BLT, SB_BGT, SB_BLE, SB_BGE,
+    SB_JAL,  // target in a/ka, link in kb
+    SB_HALT,
+    SB_SLOW, // a branch or jal next to another one: interpreted, for the nested delay slots
+    SB_MEM   // loads and stores: interpreted, in their turn among the cores
+};
+
+typedef struct {
+    uint8_t op;   // SB_*
+    uint8_t dst;  // register the ALU op writes
+    uint8_t a;    // rs, or the jal target
+    uint8_t b;    // rt
+    uint8_t d;    // rd: branch target, mac accumulator
+    uint16_t len; // ops from here to the end of the superblock: the delay slot after a branch, halt, or the op before a slow one
+    uint32_t ka, kb, kd; // added to R[a], R[b], R[d]
+} SuperOp;
+
 typedef struct {
     bool active;
     int cmd;
     uint32_t addr;
     int origin;
+    int source; // REQ_*
 } BusRequest;
 
+typedef struct {
+    // Sparse main memory: absent pages read as zero
+    uint32_t *pages[MEM_PAGES];
+    uint32_t high_water; // one past the highest address that ever held a non-zero word
+} MainMemory;
+
+typedef struct {
+    uint32_t hits;               // transactions the L2 supplied after its hit latency
+    uint32_t peer_fills;         // L2 hits a private cache supplied instead (modified or exclusive peer)
+    uint32_t misses;             // transactions main memory supplied
+    uint32_t evictions;          // valid L2 lines replaced by a fill
+    uint32_t back_invalidations; // private-cache lines invalidated to keep the L2 inclusive
+    uint32_t back_writebacks;    // of those, modified lines written back to memory
+} L2Stats;
+
+typedef struct {
+    // Shared inclusive L2 behind the bus (-l2). Tags only: main memory takes every flush and writeback, so a
+    // valid L2 line always holds memory's copy of its block. Every private line is also in the L2, so the
+    // per-line sharer vector is a snoop filter and a block the L2 misses needs no probes at all.
+    Cache tags;        // L2_VALID or MESI_I per line, no data storage
+    uint32_t *sharers; // per line slot: bit i set whenever core i's cache may hold the block
+    int delay;
+    L2Stats stats;
+} SharedL2;
+
+typedef struct {
+    // Inclusive sharer vector per memory block: bit i set whenever core i's cache may hold the block.
+    // Set on every fill, cleared on eviction and invalidation, so a clear bit means the probe would miss.
+    uint32_t *sharers; // MAIN_MEM_WORDS >> offset_bits entries, NULL when -snoop-filter is off or with -l2
+    int offset_bits;
+    SharedL2 *l2;      // -l2: the L2 lines carry the sharer vectors instead, NULL otherwise
+} SnoopFilter;
+
+typedef struct {
+    // Granted request waiting for its data on the split-transaction bus
+    int cmd;
+    int origin;
+    int source;
+    uint32_t addr;
+    int shared;
+    int provider;
+    int ready; // first cycle its flush beats may start
+    uint32_t block[MAX_BLOCK_WORDS];
+} BusTransaction;
+
 typedef struct {
     int phase; // 0 idle, 1 wait (memory latency), 2 flush (streaming data words)
     int cmd;   // BUS_RD or BUS_RDX for current transaction
     int origin;
+    int source; // requester within the origin core (REQ_*)
     uint32_t addr; // requested word address
     int shared;
-    int provider; // 0-3 cache, 4 memory
-    uint32_t block[BLOCK_WORDS];
+    int provider; // 0..num_cores-1 cache, num_cores memory
+    uint32_t block[MAX_BLOCK_WORDS];
     int delay;
     int index;
     // current cycle output
@@ -169,8 +526,181 @@ typedef struct {
     uint32_t bus_addr_out;
     uint32_t bus_data_out;
     int bus_shared_out;
+    // split-transaction bus: granted transactions not yet streaming, in grant order
+    BusTransaction queue[MAX_BUS_QUEUE];
+    int queued;
 } BusState;
 
+#define HIST_BUCKETS 32 // bucket 0 counts zeros, bucket k the values in [2^(k-1), 2^k)
+
+typedef struct {
+    uint32_t count;
+    uint64_t total;
+    uint32_t max;
+    uint32_t bucket[HIST_BUCKETS];
+} Histogram;
+
+typedef struct {
+    // Per-core counters of the bus statistics (SIM_BUS_STATS), charged to the requesting core unless noted
+    Histogram wait;         // demand requests: cycles from posting to the grant
+    Histogram miss_latency; // demand requests: cycles from posting to the last flush beat
+    uint32_t from_cache;    // granted transactions a peer cache supplied
+    uint32_t from_memory;   // granted transactions main memory supplied
+    uint32_t provided;      // transactions this core's cache supplied to a peer
+    uint32_t invalidated;   // lines this core's cache lost to a peer's transaction
+    uint32_t invalidations; // peer lines this core's transactions invalidated
+    int posted;             // cycle requests[core] went active, -1 while it is free
+    int issued[REQ_STORE_BUFFER + 1]; // post cycle of the REQ_MEM / REQ_STORE_BUFFER transaction in flight, -1 if none
+} BusCoreStats;
+
+typedef struct {
+    BusCoreStats core[MAX_CORES];
+    int window;      // cycles per utilization window
+    uint32_t *busy;  // per window: cycles the bus carried a command or a flush beat
+    int windows;     // windows touched so far
+    int capacity;
+} BusStats;
+
+// ---------- Threading helpers ----------
+
+typedef void (*ThreadFn)(void *arg);
+
+typedef struct {
+    ThreadFn fn;
+    void *arg;
+} ThreadStart;
+
+#ifdef _WIN32
+typedef HANDLE SimThread;
+
+static DWORD WINAPI thread_trampoline(LPVOID p) {
+    ThreadStart start = *(ThreadStart *)p;
+    free(p);
+    start.fn(start.arg);
+    return 0;
+}
+#else
+typedef pthread_t SimThread;
+
+static void *thread_trampoline(void *p) {
+    ThreadStart start = *(ThreadStart *)p;
+    free(p);
+    start.fn(start.arg);
+    return NULL;
+}
+#endif
+
+static void thread_start(SimThread *t, ThreadFn fn, void *arg) {
+    ThreadStart *start = (ThreadStart *)malloc(sizeof(ThreadStart));
+    if (!start) {
+        fprintf(stderr, "Failed to allocate thread start\n");
+        exit(1);
+    }
+    start->fn = fn;
+    start->arg = arg;
+#ifdef _WIN32
+    *t = CreateThread(NULL, 0, thread_trampoline, start, 0, NULL);
+    bool ok = *t != NULL;
+#else
+    bool ok = pthread_create(t, NULL, thread_trampoline, start) == 0;
+#endif
+    if (!ok) {
+        fprintf(stderr, "Failed to start thread\n");
+        exit(1);
+    }
+}
+
+static void thread_join(SimThread t) {
+#ifdef _WIN32
+    WaitForSingleObject(t, INFINITE);
+    CloseHandle(t);
+#else
+    pthread_join(t, NULL);
+#endif
+}
+
+static void thread_yield(void) {
+#ifdef _WIN32
+    SwitchToThread();
+#else
+    sched_yield();
+#endif
+}
+
+static int host_cpu_count(void) {
+#ifdef _WIN32
+    SYSTEM_INFO si;
+    GetSystemInfo(&si);
+    int n = (int)si.dwNumberOfProcessors;
+#else
+    int n = (int)sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+    return n > 0 ? n : 1;
+}
+
+static void *calloc_aligned(size_t count, size_t size) {
+    // Zeroed like calloc, starting on a cache line; release with free_aligned
+    size_t bytes = count * size;
+    void *p;
+#ifdef _WIN32
+    p = _aligned_malloc(bytes, CACHE_LINE);
+#else
+    if (posix_memalign(&p, CACHE_LINE, bytes) != 0)
+        p = NULL;
+#endif
+    if (p)
+        memset(p, 0, bytes);
+    return p;
+}
+
+static void free_aligned(void *p) {
+#ifdef _WIN32
+    _aligned_free(p);
+#else
+    free(p);
+#endif
+}
+
+static double host_seconds(void) {
+    // Monotonic wall clock for benchmark timing
+#ifdef _WIN32
+    LARGE_INTEGER freq, now;
+    QueryPerformanceFrequency(&freq);
+    QueryPerformanceCounter(&now);
+    return (double)now.QuadPart / (double)freq.QuadPart;
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec * 1e-9;
+#endif
+}
+
+static inline uint32_t atomic_load_u32(const volatile uint32_t *p) {
+    // acquire: data published before the matching store is visible after this load
+#ifdef _WIN32
+    return (uint32_t)InterlockedCompareExchange((volatile LONG *)p, 0, 0);
+#else
+    return __atomic_load_n(p, __ATOMIC_ACQUIRE);
+#endif
+}
+
+static inline void atomic_store_u32(volatile uint32_t *p, uint32_t v) {
+    // release: everything written before is visible to an acquiring reader of the new value
+#ifdef _WIN32
+    InterlockedExchange((volatile LONG *)p, (LONG)v);
+#else
+    __atomic_store_n(p, v, __ATOMIC_RELEASE);
+#endif
+}
+
+static inline uint32_t atomic_fetch_add_u32(volatile uint32_t *p, uint32_t v) {
+#ifdef _WIN32
+    return (uint32_t)InterlockedExchangeAdd((volatile LONG *)p, (LONG)v);
+#else
+    return __atomic_fetch_add(p, v, __ATOMIC_ACQ_REL);
+#endif
+}
+
 // ---------- Utility helpers ----------
 
 static int32_t sign_extend(uint32_t val, int bits) {
@@ -182,22 +712,37 @@ static int32_t sign_extend(uint32_t val, int bits) {
     return (int32_t)val;
 }
 
-static Instruction decode_inst(uint32_t raw, int pc) {
-    // Breaks the 32-bit word into opcode/rd/rs/rt/immediate and caches PC
-    Instruction inst;
-    inst.raw = raw;
-    inst.op = (raw >> 24) & 0xFF;
-    inst.rd = (raw >> 20) & 0xF;
-    inst.rs = (raw >> 16) & 0xF;
-    inst.rt = (raw >> 12) & 0xF;
-    inst.imm = sign_extend(raw & 0xFFF, 12);
-    inst.pc = pc;
-    return inst;
+static inline int popcount16(uint16_t v) {
+    int n = 0;
+    for (; v; v &= (uint16_t)(v - 1))
+        n++;
+    return n;
+}
+
+static inline int take_core(uint32_t *mask) {
+    // Removes the lowest set bit of a per-core mask (sharers, probes, invalidations) and returns its core.
+    // Walk a mask with `while (mask) { int i = take_core(&mask); ... }`: shifting a mask right by the core
+    // index would shift by 32 once core 31 is set.
+    int i = 0;
+    while (!((*mask >> i) & 1))
+        i++;
+    *mask &= *mask - 1;
+    return i;
+}
+
+static inline bool is_control(const Instruction *inst) {
+    // Branches and jal, which are followed by a delay slot
+    return (inst->op >= OP_BEQ && inst->op <= OP_BGE) || inst->op == OP_JAL;
+}
+
+static uint16_t lane_mask(const Instruction *inst) {
+    // rd..rd+3 of a vector load/store; lanes past R15 are dropped
+    return (uint16_t)(((1u << VEC_LANES) - 1) << inst->rd);
 }
 
 static int dest_reg(const Instruction *inst) {
     // Returns architectural destination register index, or -1 if none
-    if (inst->op == OP_HALT || inst->op == OP_SW)
+    if (inst->op == OP_HALT || inst->op == OP_SW || inst->op == OP_VLW || inst->op == OP_VSW)
         return -1;
     if (inst->op >= OP_BEQ && inst->op <= OP_BGE)
         return -1;
@@ -208,230 +753,831 @@ static int dest_reg(const Instruction *inst) {
     return inst->rd;
 }
 
-static void source_regs(const Instruction *inst, int *out, int *count) {
-    *count = 0;
-    // Order of sources is irrelevant here; used only for hazard detection
+static uint16_t source_mask(const Instruction *inst) {
+    // Registers read by the instruction; R0/R1 never carry hazards so they are masked out
+    uint16_t mask = 0;
     switch (inst->op) {
     case OP_ADD: case OP_SUB: case OP_AND: case OP_OR: case OP_XOR:
     case OP_MUL: case OP_SLL: case OP_SRA: case OP_SRL:
-    case OP_LW:
-        out[(*count)++] = inst->rs;
-        out[(*count)++] = inst->rt;
+    case OP_LW: case OP_LL: case OP_LWPI: case OP_VLW:
+        mask = (uint16_t)((1u << inst->rs) | (1u << inst->rt));
         break;
-    case OP_SW:
-        out[(*count)++] = inst->rd;
-        out[(*count)++] = inst->rs;
-        out[(*count)++] = inst->rt;
+    case OP_VSW:
+        mask = (uint16_t)((1u << inst->rs) | (1u << inst->rt) | lane_mask(inst));
         break;
+    case OP_MAC:
+    case OP_SW: case OP_SC:
     case OP_BEQ: case OP_BNE: case OP_BLT: case OP_BGT: case OP_BLE: case OP_BGE:
-        out[(*count)++] = inst->rs;
-        out[(*count)++] = inst->rt;
-        out[(*count)++] = inst->rd;
+        mask = (uint16_t)((1u << inst->rd) | (1u << inst->rs) | (1u << inst->rt));
         break;
     case OP_JAL:
-        out[(*count)++] = inst->rd;
+        mask = (uint16_t)(1u << inst->rd);
         break;
     default:
         break;
     }
+    return mask & ~0x3u;
 }
 
-// ---------- File helpers ----------
+static uint8_t alu_handler(const Instruction *inst) {
+    // R0 reads as zero and R1 as the instruction's own immediate, so those operands fold at predecode
+    bool commutes = inst->op == OP_ADD || inst->op == OP_OR;
+    if (commutes && inst->rs == 0 && inst->rt == 1)
+        return ALU_IMM;
+    if (commutes && inst->rt == 0)
+        return ALU_MOVE;
+    if (inst->op == OP_ADD && inst->rt == 1)
+        return ALU_ADD_IMM;
+    if (inst->op <= OP_SRL)
+        return (uint8_t)(ALU_ADD + inst->op);
+    if (inst->op == OP_MAC)
+        return ALU_MAC;
+    return inst->op == OP_JAL ? ALU_JAL : ALU_NONE;
+}
 
-static void load_imem(const char *path, uint32_t *imem) {
-    FILE *fp = fopen(path, "rt");
-    if (!fp) {
-        fprintf(stderr, "Failed to open %s\n", path);
-        exit(1);
-    }
-    char line[128];
-    int idx = 0;
-    while (idx < IMEM_SIZE && fgets(line, sizeof(line), fp)) {
-        unsigned int val = 0;
-        sscanf(line, "%x", &val);
-        imem[idx++] = val;
+static uint8_t kind_handler(const Instruction *inst) {
+    if (inst->op >= OP_BEQ && inst->op <= OP_BGE)
+        return KIND_BRANCH;
+    switch (inst->op) {
+    case OP_JAL: return KIND_JAL;
+    case OP_LW: return KIND_LW;
+    case OP_SW: return KIND_SW;
+    case OP_LL: return KIND_LL;
+    case OP_SC: return KIND_SC;
+    case OP_LWPI: return KIND_LWPI;
+    case OP_VLW: return KIND_VLW;
+    case OP_VSW: return KIND_VSW;
+    case OP_HALT: return KIND_HALT;
+    default: return KIND_ALU;
     }
-    while (idx < IMEM_SIZE)
-        imem[idx++] = 0;
-    fclose(fp);
 }
 
-static void load_mem(const char *path, uint32_t *mem) {
-    FILE *fp = fopen(path, "rt");
-    if (!fp) {
-        fprintf(stderr, "Failed to open %s\n", path);
-        exit(1);
-    }
-    char line[128];
-    int idx = 0;
-    while (idx < MAIN_MEM_WORDS && fgets(line, sizeof(line), fp)) {
-        unsigned int val = 0;
-        sscanf(line, "%x", &val);
-        mem[idx++] = val;
-    }
-    while (idx < MAIN_MEM_WORDS)
-        mem[idx++] = 0;
-    fclose(fp);
+static Instruction decode_inst(uint32_t raw, int pc) {
+    // Breaks the 32-bit word into opcode/rd/rs/rt/immediate, caches PC and the hazard masks
+    Instruction inst;
+    inst.raw = raw;
+    inst.op = (raw >> 24) & 0xFF;
+    inst.rd = (raw >> 20) & 0xF;
+    inst.rs = (raw >> 16) & 0xF;
+    inst.rt = (raw >> 12) & 0xF;
+    inst.imm = sign_extend(raw & 0xFFF, 12);
+    inst.pc = (uint16_t)pc;
+    inst.dst = (int8_t)dest_reg(&inst);
+    inst.dst_mask = (inst.dst >= 0) ? (uint16_t)(1u << inst.dst) : 0;
+    // lwpi also writes its base, unless that is R0/R1 or the load's own destination (the loaded word wins)
+    inst.dst2 = (int8_t)(inst.op == OP_LWPI && inst.rs > 1 && inst.rs != inst.rd ? inst.rs : -1);
+    if (inst.dst2 >= 0)
+        inst.dst_mask |= (uint16_t)(1u << inst.dst2);
+    if (inst.op == OP_VLW)
+        inst.dst_mask = lane_mask(&inst) & ~0x3u;
+    inst.src_mask = source_mask(&inst);
+    inst.alu = alu_handler(&inst);
+    inst.kind = kind_handler(&inst);
+    return inst;
 }
 
-static void write_trimmed_mem(const char *path, const uint32_t *mem, int size) {
-    FILE *fp = fopen(path, "wt");
-    if (!fp) {
-        fprintf(stderr, "Failed to open %s for write\n", path);
-        exit(1);
-    }
-    int last = size - 1;
-    while (last >= 0 && mem[last] == 0)
-        last--;
-    for (int i = 0; i <= last; i++)
-        fprintf(fp, "%08X\n", mem[i]);
-    fclose(fp);
+static void predecode_imem(const uint32_t *imem, Instruction *prog) {
+    for (int pc = 0; pc < IMEM_SIZE; pc++)
+        prog[pc] = decode_inst(imem[pc], pc);
 }
 
-static void write_full_mem(const char *path, const uint32_t *mem, int size) {
-    FILE *fp = fopen(path, "wt");
-    if (!fp) {
-        fprintf(stderr, "Failed to open %s for write\n", path);
-        exit(1);
-    }
-    for (int i = 0; i < size; i++)
-        fprintf(fp, "%08X\n", mem[i]);
-    fclose(fp);
+// ---------- Main memory helpers ----------
+
+static inline uint32_t mem_read(const MainMemory *mem, uint32_t addr) {
+    addr &= MAIN_MEM_WORDS - 1;
+    const uint32_t *page = mem->pages[addr / MEM_PAGE_WORDS];
+    return page ? page[addr % MEM_PAGE_WORDS] : 0;
 }
 
-static void write_regout(const char *path, const uint32_t *regs) {
-    FILE *fp = fopen(path, "wt");
-    if (!fp) {
-        fprintf(stderr, "Failed to open %s for write\n", path);
-        exit(1);
+static uint32_t *mem_page(MainMemory *mem, uint32_t addr) {
+    uint32_t **slot = &mem->pages[addr / MEM_PAGE_WORDS];
+    if (!*slot) {
+        *slot = (uint32_t *)calloc(MEM_PAGE_WORDS, sizeof(uint32_t));
+        if (!*slot) {
+            fprintf(stderr, "Failed to allocate main memory\n");
+            exit(1);
+        }
     }
-    for (int i = 2; i < REG_COUNT; i++)
-        fprintf(fp, "%08X\n", regs[i]);
-    fclose(fp);
+    return *slot;
 }
 
-static void write_stats(const char *path, const Stats *s) {
-    FILE *fp = fopen(path, "wt");
-    if (!fp) {
-        fprintf(stderr, "Failed to open %s for write\n", path);
-        exit(1);
-    }
-    fprintf(fp, "cycles %u\n", s->cycles);
-    fprintf(fp, "instructions %u\n", s->instructions);
-    fprintf(fp, "read_hit %u\n", s->read_hit);
-    fprintf(fp, "write_hit %u\n", s->write_hit);
-    fprintf(fp, "read_miss %u\n", s->read_miss);
-    fprintf(fp, "write_miss %u\n", s->write_miss);
-    fprintf(fp, "decode_stall %u\n", s->decode_stall);
-    fprintf(fp, "mem_stall %u\n", s->mem_stall);
-    fclose(fp);
+static inline void mem_write(MainMemory *mem, uint32_t addr, uint32_t val) {
+    addr &= MAIN_MEM_WORDS - 1;
+    if (val == 0 && !mem->pages[addr / MEM_PAGE_WORDS])
+        return; // zero into an untouched page: stays sparse
+    mem_page(mem, addr)[addr % MEM_PAGE_WORDS] = val;
+    if (val != 0 && addr >= mem->high_water)
+        mem->high_water = addr + 1;
 }
 
-// ---------- Cache helpers ----------
+static void mem_read_block(const MainMemory *mem, uint32_t base, uint32_t *block, int words) {
+    // base is block aligned, so the whole block sits in one page
+    base &= MAIN_MEM_WORDS - 1;
+    const uint32_t *page = mem->pages[base / MEM_PAGE_WORDS];
+    for (int i = 0; i < words; i++)
+        block[i] = page ? page[base % MEM_PAGE_WORDS + i] : 0;
+}
 
-static inline int cache_index(uint32_t addr) {
-    return (addr >> OFFSET_BITS) & INDEX_MASK;
+static void mem_write_block(MainMemory *mem, uint32_t base, const uint32_t *block, int words) {
+    for (int i = 0; i < words; i++)
+        mem_write(mem, base + i, block[i]);
 }
 
-static inline uint32_t cache_tag(uint32_t addr) {
-    return (addr >> (OFFSET_BITS + INDEX_BITS)) & TAG_MASK;
+static void mem_clear(MainMemory *mem) {
+    // Zeroes the touched pages but keeps them allocated for reuse
+    for (int i = 0; i < MEM_PAGES; i++) {
+        if (mem->pages[i])
+            memset(mem->pages[i], 0, MEM_PAGE_WORDS * sizeof(uint32_t));
+    }
+    mem->high_water = 0;
 }
 
-static inline uint32_t line_base_addr(uint32_t tag, int index) {
-    return ((tag & TAG_MASK) << (OFFSET_BITS + INDEX_BITS)) | ((uint32_t)index << OFFSET_BITS);
+static void mem_free(MainMemory *mem) {
+    for (int i = 0; i < MEM_PAGES; i++) {
+        free(mem->pages[i]);
+        mem->pages[i] = NULL;
+    }
+    mem->high_water = 0;
 }
 
-static void writeback_line(Cache *c, int idx, uint32_t *mem) {
-    // Write back dirty block before eviction
-    if (c->state[idx] != MESI_M)
+// ---------- Input image loading ----------
+
+typedef struct {
+    // Read-only view of a whole input file
+    const unsigned char *data;
+    size_t size;
+#ifdef _WIN32
+    HANDLE file;
+    HANDLE mapping;
+#endif
+} MappedFile;
+
+static void map_file(const char *path, MappedFile *m) {
+    memset(m, 0, sizeof(*m));
+#ifdef _WIN32
+    m->file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    LARGE_INTEGER size;
+    if (m->file == INVALID_HANDLE_VALUE || !GetFileSizeEx(m->file, &size)) {
+        fprintf(stderr, "Failed to open %s\n", path);
+        exit(1);
+    }
+    m->size = (size_t)size.QuadPart;
+    if (m->size == 0)
+        return;
+    m->mapping = CreateFileMappingA(m->file, NULL, PAGE_READONLY, 0, 0, NULL);
+    m->data = m->mapping ? (const unsigned char *)MapViewOfFile(m->mapping, FILE_MAP_READ, 0, 0, 0) : NULL;
+#else
+    int fd = open(path, O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        fprintf(stderr, "Failed to open %s\n", path);
+        exit(1);
+    }
+    m->size = (size_t)st.st_size;
+    if (m->size == 0) {
+        close(fd);
         return;
-    uint32_t base = line_base_addr(c->tag[idx], idx);
-    for (int i = 0; i < BLOCK_WORDS; i++) {
-        uint32_t addr = (base + i) & (MAIN_MEM_WORDS - 1);
-        mem[addr] = c->data[idx * BLOCK_WORDS + i];
+    }
+    void *p = mmap(NULL, m->size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    m->data = (p == MAP_FAILED) ? NULL : (const unsigned char *)p;
+#endif
+    if (!m->data) {
+        fprintf(stderr, "Failed to map %s\n", path);
+        exit(1);
     }
 }
 
-static void fill_cache_line(Cache *c, int idx, uint32_t tag, const uint32_t *block, int new_state, uint32_t *mem) {
-    // Evict + fill helper used by bus completion
-    writeback_line(c, idx, mem);
-    for (int i = 0; i < BLOCK_WORDS; i++)
-        c->data[idx * BLOCK_WORDS + i] = block[i];
-    c->tag[idx] = tag & TAG_MASK;
-    c->state[idx] = new_state;
+static void unmap_file(MappedFile *m) {
+#ifdef _WIN32
+    if (m->data)
+        UnmapViewOfFile(m->data);
+    if (m->mapping)
+        CloseHandle(m->mapping);
+    CloseHandle(m->file);
+#else
+    if (m->data)
+        munmap((void *)m->data, m->size);
+#endif
 }
 
-static bool cache_lookup(Cache *c, uint32_t addr, int *state_out) {
-    // Direct-mapped lookup, returns true on tag hit
-    int idx = cache_index(addr);
-    uint32_t tag = cache_tag(addr);
-    if (c->state[idx] != MESI_I && c->tag[idx] == tag) {
-        if (state_out)
-            *state_out = c->state[idx];
-        return true;
-    }
-    return false;
+static inline uint32_t hex_digit(unsigned char ch) {
+    // 0-15 for a hex digit, 0x80 otherwise; compiles to compares and selects, no table or branch
+    uint32_t d = (uint32_t)ch - '0';
+    uint32_t a = ((uint32_t)ch | 0x20) - 'a';
+    return d < 10 ? d : (a < 6 ? a + 10 : 0x80);
 }
 
-static uint32_t cache_read(Cache *c, uint32_t addr) {
-    int idx = cache_index(addr);
-    int offset = addr & OFFSET_MASK;
-    return c->data[idx * BLOCK_WORDS + offset];
-}
+typedef struct {
+    const unsigned char *p;
+    const unsigned char *end;
+} HexCursor;
 
-static void cache_write(Cache *c, uint32_t addr, uint32_t data) {
-    int idx = cache_index(addr);
-    int offset = addr & OFFSET_MASK;
-    c->data[idx * BLOCK_WORDS + offset] = data;
+static bool hex_next_word(HexCursor *cur, uint32_t *out) {
+    // One word per line with sscanf("%x") semantics: blank/garbage lines read as 0
+    const unsigned char *p = cur->p, *end = cur->end;
+    if (p >= end)
+        return false;
+    uint32_t val = 0;
+    if (end - p >= 9) {
+        // Fast path for the generated "%08X" layout: eight digits, then end of line
+        uint32_t bad = 0;
+        for (int i = 0; i < 8; i++) {
+            uint32_t d = hex_digit(p[i]);
+            bad |= d;
+            val = (val << 4) | (d & 0xF);
+        }
+        if (!(bad & 0x80) && (p[8] == '\n' || p[8] == '\r')) {
+            p += 8;
+            goto line_end;
+        }
+        val = 0;
+    }
+    while (p < end && (*p == ' ' || *p == '\t' || *p == '\r' || *p == '\v' || *p == '\f'))
+        p++;
+    bool neg = false;
+    if (p < end && (*p == '+' || *p == '-'))
+        neg = *p++ == '-';
+    if (end - p >= 3 && p[0] == '0' && (p[1] | 0x20) == 'x' && hex_digit(p[2]) < 16)
+        p += 2;
+    for (uint32_t d; p < end && (d = hex_digit(*p)) < 16; p++)
+        val = (val << 4) | d;
+    if (neg)
+        val = 0u - val;
+line_end:
+    while (p < end && *p != '\n')
+        p++;
+    cur->p = (p < end) ? p + 1 : end;
+    *out = val;
+    return true;
 }
 
-// ---------- Bus helpers ----------
+static inline uint32_t read_le32(const unsigned char *p) {
+    return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
 
-static void reset_bus_out(BusState *bus) {
-    bus->bus_cmd_out = BUS_NONE;
-    bus->bus_origid_out = 0;
-    bus->bus_addr_out = 0;
-    bus->bus_data_out = 0;
-    bus->bus_shared_out = 0;
+static bool is_binary_image(const char *path) {
+    // raw little-endian words, e.g. memin.bin
+    size_t n = strlen(path);
+    return n >= 4 && path[n - 4] == '.' && (path[n - 3] | 0x20) == 'b' && (path[n - 2] | 0x20) == 'i' &&
+           (path[n - 1] | 0x20) == 'n';
 }
 
-static void complete_transaction(BusState *bus, Core cores[NUM_CORES], uint32_t *mem) {
-    // Flush completes: memory gets the block, requester cache filled
-    if (bus->origin < 0 || bus->origin >= NUM_CORES)
-        return;
-    uint32_t base = bus->addr & ~(BLOCK_WORDS - 1);
-    for (int i = 0; i < BLOCK_WORDS; i++) {
-        uint32_t addr = (base + i) & (MAIN_MEM_WORDS - 1);
-        mem[addr] = bus->block[i];
+static void load_imem(const char *path, uint32_t *imem) {
+    MappedFile m;
+    map_file(path, &m);
+    int idx = 0;
+    if (is_binary_image(path)) {
+        for (; idx < IMEM_SIZE && (size_t)(idx + 1) * 4 <= m.size; idx++)
+            imem[idx] = read_le32(m.data + 4 * (size_t)idx);
+    } else {
+        HexCursor cur = {m.data, m.data + m.size};
+        while (idx < IMEM_SIZE && hex_next_word(&cur, &imem[idx]))
+            idx++;
     }
-    Core *c = &cores[bus->origin];
-    int idx = cache_index(base);
-    uint32_t tag = cache_tag(base);
-    int new_state = (bus->cmd == BUS_RD) ? (bus->shared ? MESI_S : MESI_E) : MESI_M;
-    fill_cache_line(&c->cache, idx, tag, bus->block, new_state, mem);
+    while (idx < IMEM_SIZE)
+        imem[idx++] = 0;
+    unmap_file(&m);
+}
 
-    if (c->mem.valid && c->mem.waiting) {
-        c->mem.waiting = false;
-        // allow mem stage to re-access without recounting miss
+static void load_mem(const char *path, MainMemory *mem) {
+    MappedFile m;
+    map_file(path, &m);
+    uint32_t idx = 0;
+    if (is_binary_image(path)) {
+        size_t words = m.size / 4;
+        if (words > MAIN_MEM_WORDS)
+            words = MAIN_MEM_WORDS;
+        for (; idx < words; idx++)
+            mem_write(mem, idx, read_le32(m.data + 4 * (size_t)idx));
+    } else {
+        HexCursor cur = {m.data, m.data + m.size};
+        uint32_t val;
+        while (idx < MAIN_MEM_WORDS && hex_next_word(&cur, &val))
+            mem_write(mem, idx++, val);
     }
+    unmap_file(&m);
 }
 
-static void apply_snoop(Cache *cache, int cache_id, int origin, int cmd, uint32_t addr, int *shared, int *provider, uint32_t *provider_block) {
-    // Snooping reactions: invalidate/transition and optionally source data
-    if (cache_id == origin)
-        return;
-    int idx = cache_index(addr);
-    uint32_t tag = cache_tag(addr);
-    int state = cache->state[idx];
-    if (state == MESI_I || cache->tag[idx] != tag)
-        return;
+// ---------- Assembly sources ----------
 
-    *shared = 1;
-    if (state == MESI_M) {
-        *provider = cache_id;
-        for (int i = 0; i < BLOCK_WORDS; i++)
-            provider_block[i] = cache->data[idx * BLOCK_WORDS + i];
-        if (cmd == BUS_RD)
+#define ASM_CACHE_MAGIC "SIMASMC" // 8 bytes with the terminator
+#define ASM_CACHE_VERSION 1
+#define ASM_CACHE_HEADER_BYTES 32 // magic, version, source size, source hash (2 words), imem words, data words
+#define ASM_CACHE_PATH_MAX 1024
+
+static bool is_asm_source(const char *path) {
+    size_t n = strlen(path);
+    return n >= 4 && path[n - 4] == '.' && (path[n - 3] | 0x20) == 'a' && (path[n - 2] | 0x20) == 's' &&
+           (path[n - 1] | 0x20) == 'm';
+}
+
+static uint64_t source_hash(const unsigned char *p, size_t n) {
+    uint64_t h = 14695981039346656037ull; // FNV-1a
+    for (size_t i = 0; i < n; i++)
+        h = (h ^ p[i]) * 1099511628211ull;
+    return h;
+}
+
+static void asm_cache_path(char *out, const char *dir, uint64_t hash) {
+    snprintf(out, ASM_CACHE_PATH_MAX, "%s/%08X%08X.bin", dir, (unsigned)(hash >> 32), (unsigned)hash);
+}
+
+static bool read_asm_cache(const char *path, uint64_t hash, size_t size, uint32_t *imem, MainMemory *mem) {
+    // false on a miss or a stale/partial entry; nothing is applied until the whole entry has been read
+    FILE *fp = fopen(path, "rb");
+    if (!fp)
+        return false;
+    uint8_t hdr[ASM_CACHE_HEADER_BYTES];
+    uint8_t *body = NULL;
+    bool ok = fread(hdr, 1, sizeof(hdr), fp) == sizeof(hdr) && memcmp(hdr, ASM_CACHE_MAGIC, 8) == 0 &&
+              trace_get_u32(hdr + 8) == ASM_CACHE_VERSION && trace_get_u32(hdr + 12) == (uint32_t)size &&
+              trace_get_u32(hdr + 16) == (uint32_t)hash && trace_get_u32(hdr + 20) == (uint32_t)(hash >> 32);
+    uint32_t insts = ok ? trace_get_u32(hdr + 24) : 0;
+    uint32_t words = ok ? trace_get_u32(hdr + 28) : 0;
+    ok = ok && insts <= IMEM_SIZE && words <= MAIN_MEM_WORDS;
+    size_t body_bytes = 4 * (size_t)insts + 8 * (size_t)words;
+    if (ok) {
+        body = (uint8_t *)malloc(body_bytes ? body_bytes : 1);
+        ok = body && fread(body, 1, body_bytes, fp) == body_bytes;
+    }
+    fclose(fp);
+    if (ok) {
+        for (uint32_t i = 0; i < IMEM_SIZE; i++)
+            imem[i] = i < insts ? trace_get_u32(body + 4 * i) : 0;
+        const uint8_t *w = body + 4 * (size_t)insts;
+        for (uint32_t i = 0; i < words; i++, w += 8)
+            mem_write(mem, trace_get_u32(w) & (MAIN_MEM_WORDS - 1), trace_get_u32(w + 4));
+    }
+    free(body);
+    return ok;
+}
+
+static void write_asm_cache(const char *path, uint64_t hash, size_t size, const asm_program *a) {
+    // A cache entry that cannot be written is skipped; readers reject a partial one
+    size_t bytes = ASM_CACHE_HEADER_BYTES + 4 * (size_t)a->imem_len + 8 * (size_t)a->word_count;
+    uint8_t *buf = (uint8_t *)malloc(bytes);
+    FILE *fp = buf ? fopen(path, "wb") : NULL;
+    if (fp) {
+        memcpy(buf, ASM_CACHE_MAGIC, 8);
+        trace_put_u32(buf + 8, ASM_CACHE_VERSION);
+        trace_put_u32(buf + 12, (uint32_t)size);
+        trace_put_u32(buf + 16, (uint32_t)hash);
+        trace_put_u32(buf + 20, (uint32_t)(hash >> 32));
+        trace_put_u32(buf + 24, (uint32_t)a->imem_len);
+        trace_put_u32(buf + 28, (uint32_t)a->word_count);
+        uint8_t *p = buf + ASM_CACHE_HEADER_BYTES;
+        for (int i = 0; i < a->imem_len; i++, p += 4)
+            trace_put_u32(p, (uint32_t)a->imem[i]);
+        for (int i = 0; i < a->word_count; i++, p += 8) {
+            trace_put_u32(p, (uint32_t)a->words[i].addr);
+            trace_put_u32(p + 4, (uint32_t)a->words[i].data);
+        }
+        fwrite(buf, 1, bytes, fp);
+        fclose(fp);
+    }
+    free(buf);
+}
+
+static void load_asm(const char *path, uint32_t *imem, MainMemory *mem, const char *cache_dir) {
+    // Assembles a .asm program in memory: instructions into imem, .word data straight into main memory
+    MappedFile m;
+    map_file(path, &m);
+    size_t size = m.size;
+    uint64_t hash = source_hash(m.data, size);
+    char cache_path[ASM_CACHE_PATH_MAX];
+    if (cache_dir) {
+        asm_cache_path(cache_path, cache_dir, hash);
+        if (read_asm_cache(cache_path, hash, size, imem, mem)) {
+            unmap_file(&m);
+            return;
+        }
+    }
+    asm_program *a = asm_alloc();
+    if (!a) {
+        fprintf(stderr, "Failed to allocate assembler for %s\n", path);
+        exit(1);
+    }
+    if (asm_text(a, (const char *)m.data, size) < 0) {
+        fprintf(stderr, "%s: ERROR: %s\n", path, a->error);
+        exit(1);
+    }
+    unmap_file(&m);
+    for (int i = 0; i < IMEM_SIZE; i++)
+        imem[i] = (uint32_t)a->imem[i];
+    for (int i = 0; i < a->word_count; i++)
+        mem_write(mem, (uint32_t)a->words[i].addr, (uint32_t)a->words[i].data);
+    if (cache_dir)
+        write_asm_cache(cache_path, hash, size, a);
+    asm_free(a);
+}
+
+// ---------- File helpers ----------
+
+// Word dumps are "%08X\n" lines, formatted into one buffer sized up front and written with a single fwrite
+#define HEX_LINE 9
+
+static char *alloc_hex_lines(int count) {
+    char *buf = (char *)malloc((size_t)(count > 0 ? count : 1) * HEX_LINE);
+    if (!buf) {
+        fprintf(stderr, "Failed to allocate output buffer\n");
+        exit(1);
+    }
+    return buf;
+}
+
+static inline char *put_hex_line(char *p, uint32_t v) {
+    p = trace_hex_fixed(p, v, 8);
+    *p++ = '\n';
+    return p;
+}
+
+static void write_hex_lines(const char *path, const char *buf, int count) {
+    FILE *fp = fopen(path, "wt");
+    if (!fp) {
+        fprintf(stderr, "Failed to open %s for write\n", path);
+        exit(1);
+    }
+    size_t len = (size_t)count * HEX_LINE;
+    if (fwrite(buf, 1, len, fp) != len) {
+        fprintf(stderr, "Failed to write %s\n", path);
+        exit(1);
+    }
+    fclose(fp);
+}
+
+static void write_trimmed_mem(const char *path, const MainMemory *mem) {
+    // Nothing non-zero lives at or above the high-water mark; trim trailing zeros below it
+    int last = (int)mem->high_water - 1;
+    while (last >= 0 && mem_read(mem, (uint32_t)last) == 0)
+        last--;
+    char *buf = alloc_hex_lines(last + 1);
+    char *p = buf;
+    for (int i = 0; i <= last; i++)
+        p = put_hex_line(p, mem_read(mem, (uint32_t)i));
+    write_hex_lines(path, buf, last + 1);
+    free(buf);
+}
+
+static void write_full_mem(const char *path, const uint32_t *mem, int size) {
+    char *buf = alloc_hex_lines(size);
+    char *p = buf;
+    for (int i = 0; i < size; i++)
+        p = put_hex_line(p, mem[i]);
+    write_hex_lines(path, buf, size);
+    free(buf);
+}
+
+static void write_regout(const char *path, const uint32_t *regs) {
+    write_full_mem(path, regs + 2, REG_COUNT - 2);
+}
+
+static void write_stats(const char *path, const Stats *s, const MachineConfig *cfg, bool sampled) {
+    FILE *fp = fopen(path, "wt");
+    if (!fp) {
+        fprintf(stderr, "Failed to open %s for write\n", path);
+        exit(1);
+    }
+    fprintf(fp, "cycles %u\n", s->cycles);
+    fprintf(fp, "instructions %u\n", s->instructions);
+    fprintf(fp, "read_hit %u\n", s->read_hit);
+    fprintf(fp, "write_hit %u\n", s->write_hit);
+    fprintf(fp, "read_miss %u\n", s->read_miss);
+    fprintf(fp, "write_miss %u\n", s->write_miss);
+    fprintf(fp, "decode_stall %u\n", s->decode_stall);
+    fprintf(fp, "mem_stall %u\n", s->mem_stall);
+    if (cfg->critical_word_first) {
+        fprintf(fp, "early_restart %u\n", s->early_restart);
+        fprintf(fp, "fill_stall %u\n", s->fill_stall);
+    }
+    if (cfg->forwarding) {
+        fprintf(fp, "forwarded %u\n", s->forwarded);
+        fprintf(fp, "load_use_stall %u\n", s->load_use_stall);
+    }
+    if (cfg->store_buffer) {
+        fprintf(fp, "sb_forward %u\n", s->sb_forward);
+        fprintf(fp, "sb_full_stall %u\n", s->sb_full_stall);
+    }
+    if (cfg->prefetch != PREFETCH_NONE) {
+        fprintf(fp, "prefetch_issued %u\n", s->prefetch_issued);
+        fprintf(fp, "prefetch_useful %u\n", s->prefetch_useful);
+        fprintf(fp, "prefetch_late %u\n", s->prefetch_late);
+    }
+    if (cfg->snoop_filter || cfg->l2_lines) {
+        fprintf(fp, "snoop_probes %u\n", s->snoop_probes);
+        fprintf(fp, "snoop_filtered %u\n", s->snoop_filtered);
+    }
+    if (s->sc_success || s->sc_fail) {
+        fprintf(fp, "sc_success %u\n", s->sc_success);
+        fprintf(fp, "sc_fail %u\n", s->sc_fail);
+    }
+    if (sampled) {
+        // whole-run estimate: every instruction, detailed or functional, at the measured CPI. Without a measured
+        // instruction there is no CPI, so the line is left out (sim_run_sampled warns) rather than written as 0.
+        uint64_t total = (uint64_t)s->instructions + s->functional_instructions;
+        fprintf(fp, "functional_instructions %u\n", s->functional_instructions);
+        fprintf(fp, "sample_cycles %u\n", s->sample_cycles);
+        fprintf(fp, "sample_instructions %u\n", s->sample_instructions);
+        if (s->sample_instructions)
+            fprintf(fp, "est_cycles %llu\n", (unsigned long long)(total * s->sample_cycles / s->sample_instructions));
+    }
+    fclose(fp);
+}
+
+// ---------- Cache helpers ----------
+
+static int log2_exact(int v) {
+    // log2 of a power of two, -1 otherwise
+    if (v <= 0 || (v & (v - 1)) != 0)
+        return -1;
+    int bits = 0;
+    while ((1 << bits) < v)
+        bits++;
+    return bits;
+}
+
+static void cache_geometry(CacheGeometry *g, int lines, int ways, int block_words, int policy) {
+    // sizes are validated powers of two (see check_machine_config)
+    g->lines = lines;
+    g->ways = ways;
+    g->way_bits = log2_exact(ways);
+    g->block_words = block_words;
+    g->offset_bits = log2_exact(block_words);
+    g->tag_shift = g->offset_bits + log2_exact(lines / ways);
+    g->offset_mask = (uint32_t)block_words - 1;
+    g->index_mask = (uint32_t)(lines / ways) - 1;
+    g->tag_mask = (1u << (ADDR_BITS - g->tag_shift)) - 1;
+    g->policy = policy;
+}
+
+static size_t cache_storage_words(const MachineConfig *cfg) {
+    // tag and replacement words, state and prefetched bytes rounded up to whole words, then the data words
+    size_t lines = (size_t)cfg->cache_lines;
+    return lines * (size_t)cfg->block_words + 2 * lines + 2 * ((lines + 3) / 4);
+}
+
+static size_t l2_storage_words(const MachineConfig *cfg) {
+    // tag, replacement and sharer words, then state bytes rounded up to whole words
+    size_t lines = (size_t)cfg->l2_lines;
+    return 3 * lines + (lines + 3) / 4;
+}
+
+static void l2_attach(SharedL2 *l2, const MachineConfig *cfg, uint32_t *store) {
+    size_t lines = (size_t)cfg->l2_lines;
+    cache_geometry(&l2->tags.geo, cfg->l2_lines, cfg->l2_ways, cfg->block_words, cfg->policy);
+    l2->tags.data = NULL;
+    l2->tags.tag = store;
+    l2->tags.repl = store + lines;
+    l2->sharers = store + 2 * lines;
+    l2->tags.state = (uint8_t *)(store + 3 * lines);
+    l2->tags.prefetched = NULL;
+    l2->delay = cfg->l2_delay;
+}
+
+static void cache_attach(Cache *c, const MachineConfig *cfg, uint32_t *store) {
+    size_t lines = (size_t)cfg->cache_lines;
+    cache_geometry(&c->geo, cfg->cache_lines, cfg->ways, cfg->block_words, cfg->policy);
+    // the lookup metadata shares cache lines; DSRAM is only touched on a hit or fill, so it goes after
+    c->tag = store;
+    c->repl = c->tag + lines;
+    c->state = (uint8_t *)(c->repl + lines);
+    c->prefetched = (uint8_t *)(c->repl + lines + (lines + 3) / 4);
+    c->data = c->repl + lines + 2 * ((lines + 3) / 4);
+}
+
+static inline int cache_index(const Cache *c, uint32_t addr) {
+    // set index
+    return (int)((addr >> c->geo.offset_bits) & c->geo.index_mask);
+}
+
+static inline uint32_t cache_tag(const Cache *c, uint32_t addr) {
+    return (addr >> c->geo.tag_shift) & c->geo.tag_mask;
+}
+
+static inline uint32_t line_base_addr(const Cache *c, int slot) {
+    uint32_t set = (uint32_t)slot >> c->geo.way_bits;
+    return ((c->tag[slot] & c->geo.tag_mask) << c->geo.tag_shift) | (set << c->geo.offset_bits);
+}
+
+static inline uint32_t *line_data(Cache *c, int slot) {
+    return &c->data[(size_t)slot << c->geo.offset_bits];
+}
+
+static void writeback_line(Cache *c, int slot, MainMemory *mem) {
+    // Write back dirty block before eviction
+    if (c->state[slot] != MESI_M)
+        return;
+    mem_write_block(mem, line_base_addr(c, slot), line_data(c, slot), c->geo.block_words);
+}
+
+static inline int cache_lookup(const Cache *c, uint32_t addr) {
+    // Slot holding addr in a valid state, or -1 on a miss
+    int base = cache_index(c, addr) << c->geo.way_bits;
+    uint32_t tag = cache_tag(c, addr);
+    for (int w = 0; w < c->geo.ways; w++) {
+        if (c->state[base + w] != MESI_I && c->tag[base + w] == tag)
+            return base + w;
+    }
+    return -1;
+}
+
+static void cache_touch(Cache *c, int slot) {
+    // Record a use of slot for the replacement policy
+    if (c->geo.ways == 1)
+        return;
+    if (c->geo.policy == REPL_LRU) {
+        c->repl[slot] = ++c->clock;
+    } else if (c->geo.policy == REPL_PLRU) {
+        // heap-ordered tree of ways-1 bits; each node on the path points away from the used way
+        uint32_t *bits = &c->repl[slot >> c->geo.way_bits];
+        int way = slot & (c->geo.ways - 1);
+        int node = 1;
+        for (int level = c->geo.way_bits - 1; level >= 0; level--) {
+            int right = (way >> level) & 1;
+            if (right)
+                *bits &= ~(1u << node);
+            else
+                *bits |= 1u << node;
+            node = 2 * node + right;
+        }
+    }
+}
+
+static int cache_victim(Cache *c, uint32_t addr) {
+    // Slot to fill for addr: its current slot if present (upgrade), else an invalid way, else the policy's pick
+    int hit = cache_lookup(c, addr);
+    if (hit >= 0)
+        return hit;
+    int base = cache_index(c, addr) << c->geo.way_bits;
+    for (int w = 0; w < c->geo.ways; w++) {
+        if (c->state[base + w] == MESI_I)
+            return base + w;
+    }
+    if (c->geo.policy == REPL_LRU) {
+        int victim = base;
+        for (int w = 1; w < c->geo.ways; w++) {
+            // stamps only grow, so compare by distance for wrap-around
+            if ((int32_t)(c->repl[base + w] - c->repl[victim]) < 0)
+                victim = base + w;
+        }
+        return victim;
+    }
+    if (c->geo.policy == REPL_PLRU) {
+        uint32_t bits = c->repl[base >> c->geo.way_bits];
+        int node = 1, way = 0;
+        for (int level = 0; level < c->geo.way_bits; level++) {
+            int right = (bits >> node) & 1;
+            way = 2 * way + right;
+            node = 2 * node + right;
+        }
+        return base + way;
+    }
+    c->rng ^= c->rng << 13;
+    c->rng ^= c->rng >> 17;
+    c->rng ^= c->rng << 5;
+    return base + (int)(c->rng & (uint32_t)(c->geo.ways - 1));
+}
+
+static int fill_cache_line(Cache *c, uint32_t addr, const uint32_t *block, int new_state, MainMemory *mem,
+                           uint32_t *evicted) {
+    // Evict + fill helper used by bus completion; returns the filled slot and sets *evicted to the base
+    // address of a valid line of another block it replaced (NO_BLOCK if none)
+    int slot = cache_victim(c, addr);
+    *evicted = (c->state[slot] != MESI_I && c->tag[slot] != cache_tag(c, addr)) ? line_base_addr(c, slot) : NO_BLOCK;
+    if (c->reserved && c->reserved_block == *evicted)
+        c->reserved = false;
+    writeback_line(c, slot, mem);
+    memcpy(line_data(c, slot), block, (size_t)c->geo.block_words * sizeof(uint32_t));
+    c->tag[slot] = cache_tag(c, addr);
+    c->state[slot] = new_state;
+    c->prefetched[slot] = 0;
+    cache_touch(c, slot);
+    return slot;
+}
+
+static inline bool reservation_holds(const Cache *c, uint32_t addr) {
+    return c->reserved && c->reserved_block == (addr & ~c->geo.offset_mask);
+}
+
+static uint32_t cache_read(Cache *c, int slot, uint32_t addr) {
+    return line_data(c, slot)[addr & c->geo.offset_mask];
+}
+
+static void cache_write(Cache *c, int slot, uint32_t addr, uint32_t data) {
+    line_data(c, slot)[addr & c->geo.offset_mask] = data;
+}
+
+// ---------- Snoop filter ----------
+
+static inline uint32_t *sharer_entry(const SnoopFilter *sf, uint32_t addr) {
+    return &sf->sharers[(addr & ((1 << 20) - 1)) >> sf->offset_bits];
+}
+
+static void l2_back_invalidate(SharedL2 *l2, int slot, Core *cores, MainMemory *mem) {
+    // The L2 drops the block in slot, so every private copy goes too; modified ones are written back first
+    uint32_t base = line_base_addr(&l2->tags, slot);
+    uint32_t sharers = l2->sharers[slot];
+    while (sharers) {
+        Cache *c = &cores[take_core(&sharers)].cache;
+        if (reservation_holds(c, base))
+            c->reserved = false;
+        int idx = cache_lookup(c, base);
+        if (idx < 0)
+            continue;
+        if (c->state[idx] == MESI_M)
+            l2->stats.back_writebacks++;
+        writeback_line(c, idx, mem);
+        c->state[idx] = MESI_I;
+        l2->stats.back_invalidations++;
+    }
+    l2->sharers[slot] = 0;
+    l2->stats.evictions++;
+}
+
+static void l2_fill(SharedL2 *l2, int core, uint32_t base, uint32_t evicted, Core *cores, MainMemory *mem) {
+    // A private cache of core filled base, replacing evicted: allocate base in the L2 if it is not there
+    Cache *tags = &l2->tags;
+    int idx = evicted != NO_BLOCK ? cache_lookup(tags, evicted) : -1;
+    if (idx >= 0)
+        l2->sharers[idx] &= ~(1u << core);
+    int slot = cache_victim(tags, base);
+    if (tags->state[slot] != MESI_I && tags->tag[slot] != cache_tag(tags, base))
+        l2_back_invalidate(l2, slot, cores, mem);
+    tags->tag[slot] = cache_tag(tags, base);
+    tags->state[slot] = L2_VALID;
+    l2->sharers[slot] |= 1u << core;
+    cache_touch(tags, slot);
+}
+
+static void snoop_filter_fill(SnoopFilter *sf, int core, uint32_t base, uint32_t evicted, Core *cores, MainMemory *mem) {
+    if (sf->l2) {
+        l2_fill(sf->l2, core, base, evicted, cores, mem);
+        return;
+    }
+    if (!sf->sharers)
+        return;
+    if (evicted != NO_BLOCK)
+        *sharer_entry(sf, evicted) &= ~(1u << core);
+    *sharer_entry(sf, base) |= 1u << core;
+}
+
+// ---------- Bus helpers ----------
+
+static void reset_bus_out(BusState *bus) {
+    bus->bus_cmd_out = BUS_NONE;
+    bus->bus_origid_out = 0;
+    bus->bus_addr_out = 0;
+    bus->bus_data_out = 0;
+    bus->bus_shared_out = 0;
+}
+
+static void complete_transaction(BusState *bus, const MachineConfig *cfg, Core *cores, MainMemory *mem, SnoopFilter *sf) {
+    // Flush completes: memory gets the block, requester cache filled
+    if (bus->origin < 0 || bus->origin >= cfg->num_cores)
+        return;
+    uint32_t base = bus->addr & ~(uint32_t)(cfg->block_words - 1);
+    mem_write_block(mem, base, bus->block, cfg->block_words);
+    Core *c = &cores[bus->origin];
+    int new_state = (bus->cmd == BUS_RD) ? (bus->shared ? MESI_S : MESI_E) : MESI_M;
+    uint32_t evicted;
+    int slot = fill_cache_line(&c->cache, base, bus->block, new_state, mem, &evicted);
+    snoop_filter_fill(sf, bus->origin, base, evicted, cores, mem);
+    if (bus->source == REQ_PREFETCH) {
+        c->cache.prefetched[slot] = 1;
+        c->pf.inflight = false;
+        return;
+    }
+    if (bus->source == REQ_STORE_BUFFER) {
+        c->sb.pending = false; // the head store writes the line on its next drain attempt
+        return;
+    }
+    if (c->fill_pending && c->fill_block == base)
+        c->fill_pending = false;
+
+    if (PIPE(c)->mem.valid && PIPE(c)->mem.waiting && (PIPE(c)->mem.mem_addr & ~(uint32_t)(cfg->block_words - 1)) == base) {
+        PIPE(c)->mem.waiting = false;
+        // allow mem stage to re-access without recounting miss
+    }
+}
+
+static bool apply_snoop(Cache *cache, int cache_id, int origin, int cmd, uint32_t addr, int *shared, int *provider, uint32_t *provider_block,
+                        uint32_t *invalidated) {
+    // Snooping reactions: invalidate/transition and optionally source data; returns whether the peer cache
+    // still holds the block afterwards and marks the peer in invalidated when it lost the block
+    if (cache_id == origin)
+        return true;
+    if (cmd == BUS_RDX && reservation_holds(cache, addr))
+        cache->reserved = false;
+    int idx = cache_lookup(cache, addr);
+    if (idx < 0)
+        return false;
+    int state = cache->state[idx];
+
+    *shared = 1;
+    if (state == MESI_M) {
+        *provider = cache_id;
+        memcpy(provider_block, line_data(cache, idx), (size_t)cache->geo.block_words * sizeof(uint32_t));
+        if (cmd == BUS_RD)
             cache->state[idx] = MESI_S;
         else
             cache->state[idx] = MESI_I;
@@ -441,515 +1587,3520 @@ static void apply_snoop(Cache *cache, int cache_id, int origin, int cmd, uint32_
     } else if (state == MESI_S && cmd == BUS_RDX) {
         cache->state[idx] = MESI_I;
     }
+    if (cache->state[idx] != MESI_I)
+        return true;
+    *invalidated |= 1u << cache_id;
+    return false;
+}
+
+static int snoop_request(const BusRequest *req, const MachineConfig *cfg, Core *cores, MainMemory *mem, SnoopFilter *sf,
+                         BusTransaction *t, uint32_t *invalidated) {
+    // Capture snapshot of request and decide data source (memory or peer cache); returns the latency before
+    // the first flush beat may go out. invalidated collects the peer caches that lost the block.
+    t->cmd = req->cmd;
+    t->origin = req->origin;
+    t->source = req->source;
+    t->addr = req->addr;
+    t->shared = 0;
+    t->provider = -1;
+    uint32_t provider_block[MAX_BLOCK_WORDS] = {0};
+    *invalidated = 0;
+
+    SharedL2 *l2 = sf->l2;
+    int l2_slot = l2 ? cache_lookup(&l2->tags, req->addr) : -1;
+    if (sf->sharers || l2) {
+        // probe only the recorded sharers; a probe that misses or invalidates clears the bit. A block the
+        // inclusive L2 does not hold is in no private cache.
+        uint32_t *entry = l2 ? (l2_slot >= 0 ? &l2->sharers[l2_slot] : NULL) : sharer_entry(sf, req->addr);
+        uint32_t probe = entry ? *entry & ~(1u << req->origin) : 0;
+        Stats *st = &cores[req->origin].stats;
+        int probes = 0;
+        while (probe) {
+            int i = take_core(&probe);
+            probes++;
+            if (!apply_snoop(&cores[i].cache, i, req->origin, req->cmd, req->addr, &t->shared, &t->provider, provider_block,
+                             invalidated))
+                *entry &= ~(1u << i);
+        }
+        st->snoop_probes += (uint32_t)probes;
+        st->snoop_filtered += (uint32_t)(cfg->num_cores - 1 - probes);
+    } else {
+        // snoop caches
+        for (int i = 0; i < cfg->num_cores; i++) {
+            apply_snoop(&cores[i].cache, i, req->origin, req->cmd, req->addr, &t->shared, &t->provider, provider_block, invalidated);
+        }
+    }
+
+    if (l2_slot >= 0)
+        cache_touch(&l2->tags, l2_slot);
+    if (t->provider == -1) {
+        // served by memory, or by the L2 on memory's side of the bus (same origin id, shorter latency)
+        t->provider = cfg->num_cores;
+        mem_read_block(mem, req->addr & ~(uint32_t)(cfg->block_words - 1), t->block, cfg->block_words);
+        if (l2_slot >= 0) {
+            l2->stats.hits++;
+            return l2->delay;
+        }
+        if (l2)
+            l2->stats.misses++;
+        return cfg->mem_delay;
+    }
+    // served by cache
+    if (l2_slot >= 0)
+        l2->stats.peer_fills++;
+    memcpy(t->block, provider_block, (size_t)cfg->block_words * sizeof(uint32_t));
+    return 0;
+}
+
+static void drive_bus_command(BusState *bus, const BusRequest *req, int shared) {
+    reset_bus_out(bus);
+    bus->bus_cmd_out = req->cmd;
+    bus->bus_origid_out = req->origin;
+    bus->bus_addr_out = req->addr & ((1 << 20) - 1);
+    bus->bus_shared_out = shared;
+}
+
+static void drive_flush_beat(BusState *bus, const MachineConfig *cfg, Core *cores) {
+    // Beat `index` of the streaming block; with critical-word-first the beats start at the requested word
+    // and wrap, and the first one restarts the requester's waiting lw
+    uint32_t base = bus->addr & ~(uint32_t)(cfg->block_words - 1);
+    int first = cfg->critical_word_first ? (int)(bus->addr & (uint32_t)(cfg->block_words - 1)) : 0;
+    int offset = (first + bus->index) & (cfg->block_words - 1);
+    bus->bus_cmd_out = BUS_FLUSH;
+    bus->bus_origid_out = bus->provider;
+    bus->bus_addr_out = base + (uint32_t)offset;
+    bus->bus_data_out = bus->block[offset];
+    bus->bus_shared_out = bus->shared;
+
+    if (!cfg->critical_word_first || bus->index != 0 || bus->origin < 0 || bus->origin >= cfg->num_cores)
+        return;
+    Core *c = &cores[bus->origin];
+    if (bus->source == REQ_MEM && PIPE(c)->mem.valid && PIPE(c)->mem.waiting && (PIPE(c)->mem.inst.op == OP_LW || PIPE(c)->mem.inst.op == OP_LWPI) &&
+        (PIPE(c)->mem.mem_addr & ((1 << 20) - 1)) == bus->addr) {
+        PIPE(c)->mem.waiting = false;
+        PIPE(c)->mem.word_ready = true;
+        PIPE(c)->mem.load_value = bus->block[offset];
+        c->fill_pending = true;
+        c->fill_block = base;
+        c->stats.early_restart++;
+    }
+}
+
+static void start_bus_transaction(BusState *bus, const BusRequest *req, const MachineConfig *cfg, Core *cores, MainMemory *mem,
+                                  SnoopFilter *sf, uint32_t *invalidated) {
+    // Atomic bus: the granted transaction owns the bus until its last flush beat
+    BusTransaction t;
+    bus->delay = snoop_request(req, cfg, cores, mem, sf, &t, invalidated); // 0 when a cache provides: flush next cycle
+    bus->cmd = t.cmd;
+    bus->origin = t.origin;
+    bus->source = t.source;
+    bus->addr = t.addr;
+    bus->shared = t.shared;
+    bus->provider = t.provider;
+    memcpy(bus->block, t.block, (size_t)cfg->block_words * sizeof(uint32_t));
+    bus->index = 0;
+    bus->phase = 1;
+    drive_bus_command(bus, req, t.shared);
+}
+
+// ---------- Hazard helpers ----------
+
+static inline uint16_t pending_writes(const Core *c) {
+    // Scoreboard of registers still owed by instructions in EXEC/MEM/WB
+    uint16_t mask = 0;
+    if (PIPE(c)->exec.valid)
+        mask |= PIPE(c)->exec.inst.dst_mask;
+    if (PIPE(c)->mem.valid)
+        mask |= PIPE(c)->mem.inst.dst_mask;
+    if (PIPE(c)->wb.valid)
+        mask |= PIPE(c)->wb.inst.dst_mask;
+    return mask;
+}
+
+static inline bool decode_hazard(const Core *c, bool forwarding) {
+    // No forwarding: any in-flight writer to a source reg of the decode instruction forces a stall.
+    // Forwarding: operands are resolved in EXEC, so only branches/jal (resolved here) wait, and only for writers
+    // still in EXEC or MEM; this cycle's WB commit is already in the register file.
+    const Instruction *inst = &PIPE(c)->decode.inst;
+    if (!forwarding)
+        return (inst->src_mask & pending_writes(c)) != 0;
+    if (!(inst->op >= OP_BEQ && inst->op <= OP_JAL))
+        return false;
+    uint16_t pending = 0;
+    if (PIPE(c)->exec.valid)
+        pending |= PIPE(c)->exec.inst.dst_mask;
+    if (PIPE(c)->mem.valid)
+        pending |= PIPE(c)->mem.inst.dst_mask;
+    return (inst->src_mask & pending) != 0;
+}
+
+static inline bool load_use_hazard(const Core *c) {
+    // Forwarding: an EXEC operand produced by the load/sc in MEM is not available until it reaches WB.
+    // The base lwpi advances is an EXEC result, so it forwards like any ALU result.
+    if (!PIPE(c)->exec.valid || !PIPE(c)->mem.valid || !(PIPE(c)->mem.is_load || PIPE(c)->mem.inst.op == OP_SC))
+        return false;
+    uint16_t late = PIPE(c)->mem.inst.dst_mask;
+    if (PIPE(c)->mem.inst.dst2 >= 0)
+        late &= (uint16_t)~(1u << PIPE(c)->mem.inst.dst2);
+    return (PIPE(c)->exec.inst.src_mask & late) != 0;
+}
+
+static inline int32_t forward_operand(const Core *c, int reg, int32_t decoded) {
+    // EXEC operand with bypassing: the MEM latch holds the youngest older result (EX->EX); otherwise the register
+    // file is current, since WB commits before EXEC reads (MEM->EX through WB). R0/R1 keep their decode values.
+    if (reg < 2)
+        return decoded;
+    if (PIPE(c)->mem.valid && (PIPE(c)->mem.inst.dst == reg || PIPE(c)->mem.inst.dst2 == reg))
+        return (int32_t)PIPE(c)->mem.alu_result;
+    return (int32_t)c->regs[reg];
+}
+
+static inline int32_t lane_operand(const Core *c, const Instruction *inst, int reg, bool forwarding) {
+    // vsw store data, read in EXEC: R0/R1 as decode would have read them, otherwise as forward_operand (without
+    // forwarding decode waited for every older writer, so the register file already holds the value)
+    if (reg < 2 || reg > 15)
+        return reg == 1 ? inst->imm : 0; // lanes past R15 store zero
+    return forwarding ? forward_operand(c, reg, 0) : (int32_t)c->regs[reg];
+}
+
+// ---------- Profiler ----------
+
+static inline ProfileRow *profile_row(ProfileRow *profile, const Core *c, uint16_t pc) {
+    return &profile[(size_t)c->id * IMEM_SIZE + (pc & (IMEM_SIZE - 1))];
+}
+
+static int decode_stall_stage(const Core *c, bool forwarding) {
+    // The youngest conflicting writer decides when the stall ends, so it takes the blame
+    if (!decode_hazard(c, forwarding))
+        return STALL_BUSY;
+    uint16_t src = PIPE(c)->decode.inst.src_mask;
+    if (PIPE(c)->exec.valid && (PIPE(c)->exec.inst.dst_mask & src))
+        return STALL_EXEC;
+    if (PIPE(c)->mem.valid && (PIPE(c)->mem.inst.dst_mask & src))
+        return STALL_MEM;
+    return STALL_WB;
+}
+
+// ---------- Bus statistics ----------
+
+static void hist_add(Histogram *h, uint32_t value) {
+    int k = 0;
+    while (k < HIST_BUCKETS - 1 && (value >> k) != 0)
+        k++;
+    h->bucket[k]++;
+    h->count++;
+    h->total += value;
+    if (value > h->max)
+        h->max = value;
+}
+
+static void bus_stats_grant(BusStats *bs, const BusRequest *req, int provider, int n, uint32_t invalidated, int cycle) {
+    BusCoreStats *s = &bs->core[req->origin];
+    if (req->source != REQ_PREFETCH) {
+        // a request posted before a restored checkpoint has no post cycle
+        if (s->posted >= 0)
+            hist_add(&s->wait, (uint32_t)(cycle - s->posted));
+        s->issued[req->source] = s->posted;
+        s->posted = -1;
+    }
+    if (provider < n) {
+        s->from_cache++;
+        bs->core[provider].provided++;
+    } else {
+        s->from_memory++;
+    }
+    while (invalidated) {
+        bs->core[take_core(&invalidated)].invalidated++;
+        s->invalidations++;
+    }
+}
+
+static void bus_stats_complete(BusStats *bs, const BusState *bus, int cycle) {
+    // Called on the last flush beat of a transaction
+    if (bus->source == REQ_PREFETCH || bus->origin < 0 || bus->origin >= MAX_CORES)
+        return;
+    int *issued = &bs->core[bus->origin].issued[bus->source];
+    if (*issued >= 0)
+        hist_add(&bs->core[bus->origin].miss_latency, (uint32_t)(cycle - *issued));
+    *issued = -1;
+}
+
+static void bus_stats_cycle(BusStats *bs, const BusState *bus, int cycle) {
+    // Utilization of the cycle's bus outputs; cycles skipped by fast-forward never drive the bus
+    if (bus->bus_cmd_out == BUS_NONE)
+        return;
+    int w = cycle / bs->window;
+    if (w >= bs->capacity) {
+        int capacity = bs->capacity ? bs->capacity : 64;
+        while (capacity <= w)
+            capacity *= 2;
+        uint32_t *busy = (uint32_t *)realloc(bs->busy, (size_t)capacity * sizeof(uint32_t));
+        if (!busy) {
+            fprintf(stderr, "Failed to allocate bus statistics\n");
+            exit(1);
+        }
+        memset(busy + bs->capacity, 0, (size_t)(capacity - bs->capacity) * sizeof(uint32_t));
+        bs->busy = busy;
+        bs->capacity = capacity;
+    }
+    bs->busy[w]++;
+    if (w >= bs->windows)
+        bs->windows = w + 1;
+}
+
+// ---------- Store buffer helpers ----------
+
+static inline uint32_t block_of(const Cache *cache, uint32_t addr) {
+    return addr & ((1 << 20) - 1) & ~cache->geo.offset_mask;
+}
+
+static bool own_block_busy(const Core *c, uint32_t block) {
+    // A core keeps at most one transaction per block in flight, so a read fill can never land on top of a line
+    // its own store buffer just upgraded (or the other way round)
+    if (PIPE(c)->mem.valid && PIPE(c)->mem.waiting && block_of(&c->cache, PIPE(c)->mem.mem_addr) == block)
+        return true;
+    if (c->sb.pending && block_of(&c->cache, c->sb.entries[c->sb.head].addr) == block)
+        return true;
+    if (c->pf.inflight && c->pf.inflight_block == block)
+        return true;
+    return c->fill_pending && c->fill_block == block;
+}
+
+static bool store_buffer_lookup(const StoreBuffer *sb, uint32_t addr, uint32_t *value) {
+    // Youngest buffered store to addr, for store-to-load forwarding
+    for (int k = sb->count - 1; k >= 0; k--) {
+        const StoreEntry *e = &sb->entries[(sb->head + k) % MAX_STORE_BUFFER];
+        if (e->addr == addr) {
+            *value = e->data;
+            return true;
+        }
+    }
+    return false;
+}
+
+static void store_buffer_push(StoreBuffer *sb, uint32_t addr, uint32_t data, uint16_t pc) {
+    StoreEntry *e = &sb->entries[(sb->head + sb->count) % MAX_STORE_BUFFER];
+    e->addr = addr;
+    e->data = data;
+    e->pc = pc;
+    e->counted = false;
+    sb->count++;
+}
+
+// ---------- Prefetcher ----------
+
+static bool prefetch_note_use(Core *c, int slot) {
+    // First demand access to a prefetched line; true if the line came from the prefetcher
+    if (!c->cache.prefetched[slot])
+        return false;
+    c->cache.prefetched[slot] = 0;
+    c->stats.prefetch_useful++;
+    return true;
+}
+
+static void prefetch_enqueue(Prefetcher *pf, uint32_t block) {
+    // Newest candidates win: a full queue drops its oldest entry
+    for (int k = 0; k < pf->count; k++) {
+        if (pf->queue[k] == block)
+            return;
+    }
+    if (pf->count == PREFETCH_QUEUE) {
+        memmove(&pf->queue[0], &pf->queue[1], (PREFETCH_QUEUE - 1) * sizeof(uint32_t));
+        pf->count--;
+    }
+    pf->queue[pf->count++] = block;
+}
+
+static void prefetch_train(Core *c, int policy, uint16_t pc, uint32_t addr, bool trigger) {
+    // Called once per demand access; trigger = missed, or first hit on a prefetched line
+    Prefetcher *pf = &c->pf;
+    uint32_t block = block_of(&c->cache, addr);
+    if (policy == PREFETCH_NEXT) {
+        if (trigger)
+            prefetch_enqueue(pf, (block + (uint32_t)c->cache.geo.block_words) & ((1 << 20) - 1));
+        return;
+    }
+    StrideEntry *e = &pf->table[pc & (PREFETCH_TABLE - 1)];
+    if (!e->valid || e->pc != pc) {
+        e->valid = true;
+        e->pc = pc;
+        e->stride = 0;
+        e->confidence = 0;
+    } else {
+        int32_t delta = (int32_t)(addr - e->last_addr);
+        if (delta != 0 && delta == e->stride) {
+            if (e->confidence < 3)
+                e->confidence++;
+        } else {
+            e->stride = delta;
+            e->confidence = 0;
+        }
+    }
+    e->last_addr = addr;
+    if (e->confidence >= 1) {
+        uint32_t target = block_of(&c->cache, addr + (uint32_t)e->stride);
+        if (target != block)
+            prefetch_enqueue(pf, target);
+    }
+}
+
+static void issue_prefetch(Core *c, BusRequest *req) {
+    // Posts the oldest useful candidate; the bus grants it only in a cycle with no demand request
+    Prefetcher *pf = &c->pf;
+    while (pf->count && !pf->inflight && !req->active) {
+        uint32_t block = pf->queue[0];
+        memmove(&pf->queue[0], &pf->queue[1], (size_t)(pf->count - 1) * sizeof(uint32_t));
+        pf->count--;
+        if (cache_lookup(&c->cache, block) >= 0 || own_block_busy(c, block))
+            continue;
+        req->active = true;
+        req->cmd = BUS_RD;
+        req->addr = block;
+        req->origin = c->id;
+        req->source = REQ_PREFETCH;
+        pf->inflight = true;
+        pf->inflight_block = block;
+        c->stats.prefetch_issued++;
+    }
+}
+
+static void drain_store_buffer(Core *c, BusRequest *req, ProfileRow *profile) {
+    // Writes the oldest store once its line is held in E or M; otherwise asks for the line with BUS_RDX through
+    // the core's request slot (shared with MEM) and retries after the fill
+    StoreBuffer *sb = &c->sb;
+    if (sb->count == 0 || sb->pending)
+        return;
+    StoreEntry *e = &sb->entries[sb->head];
+    int slot = cache_lookup(&c->cache, e->addr);
+    int state = slot >= 0 ? c->cache.state[slot] : MESI_I;
+    bool writable = state == MESI_E || state == MESI_M;
+    if (!e->counted) {
+        if (writable) {
+            c->stats.write_hit++;
+        } else {
+            c->stats.write_miss++;
+            if (profile)
+                profile_row(profile, c, e->pc)->write_miss++;
+        }
+        e->counted = true;
+    }
+    if (slot >= 0)
+        prefetch_note_use(c, slot);
+    if (writable) {
+        cache_write(&c->cache, slot, e->addr, e->data);
+        c->cache.state[slot] = MESI_M;
+        cache_touch(&c->cache, slot);
+        sb->head = (sb->head + 1) % MAX_STORE_BUFFER;
+        sb->count--;
+        return;
+    }
+    if (req->active || own_block_busy(c, block_of(&c->cache, e->addr)))
+        return;
+    req->active = true;
+    req->cmd = BUS_RDX;
+    req->addr = e->addr;
+    req->origin = c->id;
+    req->source = REQ_STORE_BUFFER;
+    sb->pending = true;
+}
+
+// ---------- Tracing ----------
+
+static void trace_open(TraceOut *t, const char *path, bool binary, int kind) {
+    // A trace file that cannot be created is silently skipped, as before
+    memset(t, 0, sizeof(*t));
+    t->binary = binary;
+    t->kind = kind;
+    t->until = INT_MAX;
+    t->fp = fopen(path, binary ? "wb" : "wt");
+    if (!t->fp)
+        return;
+    t->buf = (uint8_t *)malloc(TRACE_BUFFER_BYTES);
+    if (!t->buf) {
+        fprintf(stderr, "Failed to allocate trace buffer for %s\n", path);
+        exit(1);
+    }
+    if (binary) {
+        trace_put_header(t->buf, kind);
+        t->len = TRACE_HEADER_BYTES;
+    }
+}
+
+static void trace_flush(TraceOut *t) {
+    if (t->len)
+        fwrite(t->buf, 1, t->len, t->fp);
+    t->len = 0;
+}
+
+static void trace_window(TraceOut *t, int from, int until, int last) {
+    // Only rows of cycles from..until are written; with last > 0 only the rows of the run's last `last` cycles
+    t->from = from;
+    t->until = until;
+    if (!t->fp || last <= 0)
+        return;
+    t->recorder_rows = (uint32_t)last;
+    t->recorder = (TraceRow *)malloc((size_t)last * sizeof(TraceRow));
+    if (!t->recorder) {
+        fprintf(stderr, "Failed to allocate trace recorder\n");
+        exit(1);
+    }
+}
+
+static void trace_close(TraceOut *t) {
+    if (!t->fp)
+        return;
+    trace_flush(t);
+    fclose(t->fp);
+    free(t->buf);
+    free(t->recorder);
+    t->fp = NULL;
+    t->buf = NULL;
+    t->recorder = NULL;
+}
+
+static inline uint8_t *trace_reserve(TraceOut *t, size_t bytes) {
+    if (t->len + bytes > TRACE_BUFFER_BYTES)
+        trace_flush(t);
+    return t->buf + t->len;
+}
+
+static void trace_write_core(TraceOut *t, const CoreTraceRow *r) {
+    if (!t->binary) {
+        char *p = (char *)trace_reserve(t, TRACE_LINE_MAX);
+        t->len += trace_format_core_row(r, p);
+        return;
+    }
+    // Record header, then only the registers whose value changed since the previous row
+    uint8_t *p = trace_reserve(t, TRACE_CORE_RECORD_MAX);
+    uint8_t *q = p + TRACE_CORE_RECORD_BYTES;
+    uint16_t mask = 0;
+    for (int i = 0; i < TRACE_REGS; i++) {
+        if (r->regs[i] != t->last_regs[i]) {
+            mask |= (uint16_t)(1u << i);
+            t->last_regs[i] = r->regs[i];
+            trace_put_u32(q, r->regs[i]);
+            q += 4;
+        }
+    }
+    trace_put_u32(p, r->cycle);
+    for (int s = 0; s < TRACE_STAGES; s++)
+        trace_put_u16(p + 4 + 2 * s, r->pc[s]);
+    trace_put_u16(p + 14, mask);
+    t->len += (size_t)(q - p);
+}
+
+static void trace_write_bus(TraceOut *t, const BusTraceRow *r) {
+    if (!t->binary) {
+        char *p = (char *)trace_reserve(t, TRACE_LINE_MAX);
+        t->len += trace_format_bus_row(r, p);
+        return;
+    }
+    uint8_t *p = trace_reserve(t, TRACE_BUS_RECORD_BYTES);
+    trace_put_u32(p, r->cycle);
+    p[4] = (uint8_t)r->origid;
+    p[5] = (uint8_t)r->cmd;
+    p[6] = (uint8_t)r->shared;
+    p[7] = 0;
+    trace_put_u32(p + 8, r->addr);
+    trace_put_u32(p + 12, r->data);
+    t->len += TRACE_BUS_RECORD_BYTES;
+}
+
+static inline TraceRow *trace_ring_slot(TraceRing *ring) {
+    // Producer side: wait for a free slot (the writer thread drains concurrently)
+    uint32_t head = ring->head;
+    while (head - atomic_load_u32(&ring->tail) >= TRACE_RING_ROWS)
+        thread_yield();
+    return &ring->rows[head & (TRACE_RING_ROWS - 1)];
+}
+
+static inline void trace_ring_publish(TraceRing *ring) {
+    atomic_store_u32(&ring->head, ring->head + 1);
+}
+
+static void trace_emit_core(TraceOut *t, const CoreTraceRow *r) {
+    if (t->recorder) {
+        t->recorder[t->recorded++ % t->recorder_rows].core = *r;
+    } else if (t->ring) {
+        trace_ring_slot(t->ring)->core = *r;
+        trace_ring_publish(t->ring);
+    } else {
+        trace_write_core(t, r);
+    }
+}
+
+static void trace_emit_bus(TraceOut *t, const BusTraceRow *r) {
+    if (t->recorder) {
+        t->recorder[t->recorded++ % t->recorder_rows].bus = *r;
+    } else if (t->ring) {
+        trace_ring_slot(t->ring)->bus = *r;
+        trace_ring_publish(t->ring);
+    } else {
+        trace_write_bus(t, r);
+    }
+}
+
+static void trace_dump_recorder(TraceOut *t, int last_cycle) {
+    // Every trace holds at most one row per cycle, so the recorder still has all rows of the last cycles
+    if (!t->recorder)
+        return;
+    uint32_t count = t->recorded < t->recorder_rows ? t->recorded : t->recorder_rows;
+    for (uint32_t k = t->recorded - count; k != t->recorded; k++) {
+        const TraceRow *row = &t->recorder[k % t->recorder_rows];
+        if (t->kind == TRACE_KIND_CORE) {
+            if ((int64_t)row->core.cycle + t->recorder_rows > last_cycle)
+                trace_write_core(t, &row->core);
+        } else if ((int64_t)row->bus.cycle + t->recorder_rows > last_cycle) {
+            trace_write_bus(t, &row->bus);
+        }
+    }
+    t->recorded = 0;
+}
+
+// ---------- Asynchronous trace writer ----------
+
+typedef struct {
+    // Background thread that formats and writes rows queued by trace_emit_* for a set of trace files
+    TraceOut *outs[MAX_CORES + 1];
+    int count;
+    volatile uint32_t stop;
+    SimThread thread;
+} TraceWriter;
+
+static bool trace_ring_drain(TraceOut *t) {
+    TraceRing *ring = t->ring;
+    uint32_t tail = ring->tail;
+    uint32_t head = atomic_load_u32(&ring->head);
+    if (tail == head)
+        return false;
+    for (; tail != head; tail++) {
+        const TraceRow *row = &ring->rows[tail & (TRACE_RING_ROWS - 1)];
+        if (t->kind == TRACE_KIND_CORE)
+            trace_write_core(t, &row->core);
+        else
+            trace_write_bus(t, &row->bus);
+    }
+    atomic_store_u32(&ring->tail, tail);
+    return true;
+}
+
+static void trace_writer_main(void *arg) {
+    TraceWriter *w = (TraceWriter *)arg;
+    while (1) {
+        // read stop first: every row published before it was raised is drained before exiting
+        bool stopping = atomic_load_u32(&w->stop) != 0;
+        bool idle = true;
+        for (int i = 0; i < w->count; i++) {
+            if (trace_ring_drain(w->outs[i]))
+                idle = false;
+        }
+        if (idle) {
+            if (stopping)
+                break;
+            thread_yield();
+        }
+    }
+}
+
+static void trace_writer_start(TraceWriter *w, TraceOut **outs, int count) {
+    w->count = 0;
+    w->stop = 0;
+    for (int i = 0; i < count; i++) {
+        if (!outs[i]->fp || outs[i]->recorder)
+            continue;
+        outs[i]->ring = (TraceRing *)calloc(1, sizeof(TraceRing));
+        if (!outs[i]->ring) {
+            fprintf(stderr, "Failed to allocate trace ring\n");
+            exit(1);
+        }
+        w->outs[w->count++] = outs[i];
+    }
+    thread_start(&w->thread, trace_writer_main, w);
+}
+
+static void trace_writer_stop(TraceWriter *w) {
+    atomic_store_u32(&w->stop, 1);
+    thread_join(w->thread);
+    for (int i = 0; i < w->count; i++) {
+        free(w->outs[i]->ring);
+        w->outs[i]->ring = NULL;
+    }
+}
+
+static bool core_trace_active(const Core *c) {
+    // Only dump a line when something is in flight in the pipeline
+    return PIPE(c)->fetch.valid || PIPE(c)->decode.valid || PIPE(c)->exec.valid || PIPE(c)->mem.valid || PIPE(c)->wb.valid;
+}
+
+static void core_trace_row(const Core *c, int cycle, CoreTraceRow *row) {
+    // Q state of the pipeline latches plus R2-R15
+    row->cycle = (uint32_t)cycle;
+    row->pc[0] = PIPE(c)->fetch.valid ? PIPE(c)->fetch.inst.pc : TRACE_PC_NONE;
+    row->pc[1] = PIPE(c)->decode.valid ? PIPE(c)->decode.inst.pc : TRACE_PC_NONE;
+    row->pc[2] = PIPE(c)->exec.valid ? PIPE(c)->exec.inst.pc : TRACE_PC_NONE;
+    row->pc[3] = PIPE(c)->mem.valid ? PIPE(c)->mem.inst.pc : TRACE_PC_NONE;
+    row->pc[4] = PIPE(c)->wb.valid ? PIPE(c)->wb.inst.pc : TRACE_PC_NONE;
+    memcpy(row->regs, &c->regs[2], sizeof(row->regs));
+}
+
+static void write_core_trace_range(int first_cycle, int count, Core *c) {
+    // Emits one line per cycle for a pipeline that holds still over [first_cycle, first_cycle + count),
+    // clipped to the trace window
+    const TraceOut *t = &c->trace;
+    int first = first_cycle > t->from ? first_cycle : t->from;
+    int last = first_cycle + count - 1 < t->until ? first_cycle + count - 1 : t->until;
+    if (!t->fp || first > last || !core_trace_active(c))
+        return;
+    CoreTraceRow row;
+    core_trace_row(c, first, &row);
+    for (int cycle = first; cycle <= last; cycle++) {
+        row.cycle = (uint32_t)cycle;
+        trace_emit_core(&c->trace, &row);
+    }
+}
+
+static void write_core_trace(int cycle, Core *c) {
+    const TraceOut *t = &c->trace;
+    if (!t->fp || cycle < t->from || cycle > t->until || !core_trace_active(c))
+        return;
+    CoreTraceRow row;
+    core_trace_row(c, cycle, &row);
+    trace_emit_core(&c->trace, &row);
+}
+
+static void write_bus_trace(TraceOut *t, int cycle, const BusState *bus) {
+    if (!t->fp || bus->bus_cmd_out == BUS_NONE || cycle < t->from || cycle > t->until)
+        return;
+    BusTraceRow row;
+    row.cycle = (uint32_t)cycle;
+    row.origid = (uint32_t)bus->bus_origid_out;
+    row.cmd = (uint32_t)bus->bus_cmd_out;
+    row.addr = bus->bus_addr_out & ((1 << 20) - 1);
+    row.data = bus->bus_data_out;
+    row.shared = (uint32_t)bus->bus_shared_out;
+    trace_emit_bus(t, &row);
+}
+
+// ---------- Fast-forward helpers ----------
+
+static bool core_frozen(const Core *c, bool forwarding) {
+    // True when a pipeline advance would leave every latch untouched and only bump stall counters:
+    // MEM is parked on a bus miss, WB is empty and neither decode nor fetch can move.
+    if (c->done)
+        return true;
+    if (!PIPE(c)->mem.valid || !PIPE(c)->mem.waiting || PIPE(c)->wb.valid)
+        return false;
+    if (c->sb.count && !c->sb.pending)
+        return false; // the store buffer can still drain
+    if (c->pf.count && !c->pf.inflight)
+        return false; // a prefetch candidate can still be posted or dropped
+    if (PIPE(c)->decode.valid)
+        return PIPE(c)->exec.valid || decode_hazard(c, forwarding);
+    return !PIPE(c)->fetch.valid && c->stop_fetch;
+}
+
+static void fast_forward_core(Core *c, int first_cycle, int count, ProfileRow *profile, bool forwarding) {
+    // Bulk-applies `count` frozen cycles: same trace line, cycle and stall counters advance
+    if (c->done)
+        return;
+    write_core_trace_range(first_cycle, count, c);
+    c->stats.cycles += count;
+    c->stats.mem_stall += count;
+    if (profile)
+        profile_row(profile, c, PIPE(c)->mem.inst.pc)->mem_stall += count;
+    if (PIPE(c)->decode.valid) {
+        c->stats.decode_stall += count;
+        if (profile)
+            profile_row(profile, c, PIPE(c)->decode.inst.pc)->decode_stall[decode_stall_stage(c, forwarding)] += count;
+        c->regs[1] = PIPE(c)->decode.inst.imm;
+    }
+}
+
+// ---------- Execute handlers ----------
+
+typedef uint32_t (*AluOp)(const Instruction *inst, int32_t rs, int32_t rt, int32_t rd);
+
+static uint32_t alu_none(const Instruction *inst, int32_t rs, int32_t rt, int32_t rd) { (void)inst; (void)rs; (void)rt; (void)rd; return 0; }
+static uint32_t alu_add(const Instruction *inst, int32_t rs, int32_t rt, int32_t rd) { (void)inst; (void)rd; return (uint32_t)(rs + rt); }
+static uint32_t alu_sub(const Instruction *inst, int32_t rs, int32_t rt, int32_t rd) { (void)inst; (void)rd; return (uint32_t)(rs - rt); }
+static uint32_t alu_and(const Instruction *inst, int32_t rs, int32_t rt, int32_t rd) { (void)inst; (void)rd; return (uint32_t)(rs & rt); }
+static uint32_t alu_or(const Instruction *inst, int32_t rs, int32_t rt, int32_t rd) { (void)inst; (void)rd; return (uint32_t)(rs | rt); }
+static uint32_t alu_xor(const Instruction *inst, int32_t rs, int32_t rt, int32_t rd) { (void)inst; (void)rd; return (uint32_t)(rs ^ rt); }
+static uint32_t alu_mul(const Instruction *inst, int32_t rs, int32_t rt, int32_t rd) { (void)inst; (void)rd; return (uint32_t)(rs * rt); }
+static uint32_t alu_sll(const Instruction *inst, int32_t rs, int32_t rt, int32_t rd) { (void)inst; (void)rd; return (uint32_t)rs << ((uint32_t)rt & 0x1F); }
+static uint32_t alu_sra(const Instruction *inst, int32_t rs, int32_t rt, int32_t rd) { (void)inst; (void)rd; return (uint32_t)(rs >> ((uint32_t)rt & 0x1F)); }
+static uint32_t alu_srl(const Instruction *inst, int32_t rs, int32_t rt, int32_t rd) { (void)inst; (void)rd; return (uint32_t)rs >> ((uint32_t)rt & 0x1F); }
+static uint32_t alu_jal(const Instruction *inst, int32_t rs, int32_t rt, int32_t rd) { (void)rs; (void)rt; (void)rd; return (uint32_t)((inst->pc + 1) & 0x3FF); }
+static uint32_t alu_imm(const Instruction *inst, int32_t rs, int32_t rt, int32_t rd) { (void)rs; (void)rt; (void)rd; return (uint32_t)inst->imm; }
+static uint32_t alu_add_imm(const Instruction *inst, int32_t rs, int32_t rt, int32_t rd) { (void)rt; (void)rd; return (uint32_t)(rs + inst->imm); }
+static uint32_t alu_move(const Instruction *inst, int32_t rs, int32_t rt, int32_t rd) { (void)inst; (void)rt; (void)rd; return (uint32_t)rs; }
+static uint32_t alu_mac(const Instruction *inst, int32_t rs, int32_t rt, int32_t rd) { (void)inst; return (uint32_t)(rd + rs * rt); }
+
+static const AluOp alu_ops[ALU_HANDLERS] = {
+    alu_none, alu_add, alu_sub, alu_and, alu_or, alu_xor, alu_mul, alu_sll, alu_sra, alu_srl,
+    alu_jal, alu_imm, alu_add_imm, alu_move, alu_mac,
+};
+
+typedef int (*CompareOp)(int32_t rs, int32_t rt);
+
+static int cmp_eq(int32_t rs, int32_t rt) { return rs == rt; }
+static int cmp_ne(int32_t rs, int32_t rt) { return rs != rt; }
+static int cmp_lt(int32_t rs, int32_t rt) { return rs < rt; }
+static int cmp_gt(int32_t rs, int32_t rt) { return rs > rt; }
+static int cmp_le(int32_t rs, int32_t rt) { return rs <= rt; }
+static int cmp_ge(int32_t rs, int32_t rt) { return rs >= rt; }
+
+static const CompareOp compare_ops[OP_BGE - OP_BEQ + 1] = {cmp_eq, cmp_ne, cmp_lt, cmp_gt, cmp_le, cmp_ge};
+
+static inline int perform_compare(const Instruction *inst, int32_t rs, int32_t rt) {
+    // branch opcodes only
+    return compare_ops[inst->op - OP_BEQ](rs, rt);
+}
+
+static inline uint32_t perform_alu(const Instruction *inst, int32_t rs, int32_t rt, int32_t rd) {
+    return alu_ops[inst->alu](inst, rs, rt, rd);
+}
+
+// ---------- Run files ----------
+
+// A run reads and writes 6N+3 files for N cores, grouped by kind in this order
+enum {
+    RUN_IMEM,
+    RUN_MEMIN,
+    RUN_MEMOUT,
+    RUN_REGOUT,
+    RUN_CORETRACE,
+    RUN_BUSTRACE,
+    RUN_DSRAM,
+    RUN_TSRAM,
+    RUN_STATS,
+    RUN_KINDS
+};
+
+#define RUN_FILES_MAX (6 * MAX_CORES + 3)
+#define RUN_PATH_MAX 1024
+
+static const struct {
+    const char *name; // default file name; per-core kinds take the core number
+    bool per_core;
+} run_file_kinds[RUN_KINDS] = {
+    {"imem%d.txt", true},
+    {"memin.txt", false},
+    {"memout.txt", false},
+    {"regout%d.txt", true},
+    {"core%dtrace.txt", true},
+    {"bustrace.txt", false},
+    {"dsram%d.txt", true},
+    {"tsram%d.txt", true},
+    {"stats%d.txt", true},
+};
+
+static int run_file_count(int num_cores) {
+    return 6 * num_cores + 3;
+}
+
+static int run_file_index(int kind, int num_cores, int core) {
+    int index = 0;
+    for (int k = 0; k < kind; k++)
+        index += run_file_kinds[k].per_core ? num_cores : 1;
+    return index + (run_file_kinds[kind].per_core ? core : 0);
+}
+
+static void run_paths(const char *dir, int num_cores, char paths[][RUN_PATH_MAX], const char **files) {
+    // Default file names, inside dir unless it is empty
+    size_t n = strlen(dir);
+    const char *sep = (n == 0 || dir[n - 1] == '/' || dir[n - 1] == '\\') ? "" : "/";
+    int slot = 0;
+    for (int k = 0; k < RUN_KINDS; k++) {
+        int copies = run_file_kinds[k].per_core ? num_cores : 1;
+        for (int i = 0; i < copies; i++, slot++) {
+            char name[32];
+            snprintf(name, sizeof(name), run_file_kinds[k].name, i);
+            if ((size_t)snprintf(paths[slot], RUN_PATH_MAX, "%s%s%s", dir, sep, name) >= RUN_PATH_MAX) {
+                fprintf(stderr, "Run directory path too long: %s\n", dir);
+                exit(1);
+            }
+            files[slot] = paths[slot];
+        }
+    }
+}
+
+static char (*alloc_run_paths(void))[RUN_PATH_MAX] {
+    char (*paths)[RUN_PATH_MAX] = (char (*)[RUN_PATH_MAX])malloc((size_t)RUN_FILES_MAX * RUN_PATH_MAX);
+    if (!paths) {
+        fprintf(stderr, "Failed to allocate run file paths\n");
+        exit(1);
+    }
+    return paths;
+}
+
+// ---------- Simulator ----------
+
+typedef struct {
+    // Run options, read from the environment for every run
+    int max_cycles;    // SIM_MAX_CYCLES, -1 = unlimited
+    bool debug_branch; // SIM_DEBUG_BRANCH: stderr logging for branch decisions
+    bool fast_forward; // unless SIM_NO_FAST_FORWARD: skip memory-latency cycles when nothing can move
+    bool binary_trace; // SIM_TRACE_FORMAT=binary: decode later with tracecvt
+    bool async_trace;  // SIM_TRACE_ASYNC: format and write traces on a background thread
+    bool threaded;     // SIM_THREADED: step every core on its own thread
+    int trace_start;      // SIM_TRACE_START / SIM_TRACE_STOP: only cycles start..stop are traced
+    int trace_stop;       // INT_MAX = to the end of the run
+    uint32_t trace_cores; // SIM_TRACE_CORES=i,j,...: bit per core whose coreNtrace.txt is written
+    int trigger_pc;       // SIM_TRACE_PC: tracing starts once a fetch latch holds this PC, -1 = no trigger
+    int trigger_addr;     // SIM_TRACE_ADDR: tracing starts once the bus carries this address's block, -1 = no trigger
+    int trace_last;       // SIM_TRACE_LAST: flight recorder, only the run's last N cycles are written, 0 = off
+    const char *checkpoint_path; // SIM_CHECKPOINT: write the whole state here at the end of checkpoint_at
+    int checkpoint_at;           // SIM_CHECKPOINT_AT, -1 = never
+    const char *restore_path;    // SIM_RESTORE: resume from a checkpoint instead of cycle 0
+    bool sampled;          // SIM_SAMPLE=F,W,M: alternate F functional instructions per core with detailed windows
+    int sample_functional; // of W warm-up cycles and M measured cycles
+    int sample_warmup;
+    int sample_measure;
+    bool sample_cold;      // SIM_SAMPLE_COLD: functional accesses keep caches coherent but do not fill them
+    bool superblocks;      // unless SIM_NO_SUPERBLOCKS: the functional engine runs translated straight-line blocks
+    const char *asm_cache; // SIM_ASM_CACHE: directory of assembled .asm inputs, keyed by source hash
+    const char *profile_prefix; // SIM_PROFILE: per-PC stall and miss listings, <prefix>profileN.txt and .folded
+    int bus_window; // SIM_BUS_STATS[=W]: bus histograms to busstats.json with W-cycle utilization windows, 0 = off
+} SimOptions;
+
+typedef struct {
+    // Whole machine state; allocated once and reused from run to run (see batch mode)
+    MachineConfig cfg;
+    Core *cores;
+    // Each core owns a slot in requests[]; when a miss/upgrade happens MEM sets active=true and waits for arbitration.
+    BusRequest *requests;
+    BusRequest *prefetches; // per-core prefetch slot, lower arbitration priority than requests[]
+    uint32_t *cache_store; // DSRAM and TSRAM of every core, carved up by sim_alloc
+    SnoopFilter filter;
+    SharedL2 l2;         // attached to filter.l2 with -l2
+    uint32_t *l2_store;  // its tags, replacement words, sharer vectors and states
+    BusState bus;
+    int rr_next;
+    int cycle;
+    MainMemory mem;
+    TraceOut bus_trace;
+    TraceWriter writer;
+    SimOptions opt;
+    ProfileRow *profile; // IMEM_SIZE rows per core while SIM_PROFILE is set, otherwise NULL
+    SuperOp *superblocks; // IMEM_SIZE translated instructions per core for sampled runs, otherwise NULL
+    BusStats *bus_stats; // while SIM_BUS_STATS is set, otherwise NULL
+    bool trace_armed;    // SIM_TRACE_PC or SIM_TRACE_ADDR is set and has not fired yet
+    int dump_threads;    // helpers writing the end-of-run outputs next to the caller, 0 in batch workers
+    char checkpoint_path[RUN_PATH_MAX]; // SIM_CHECKPOINT, a relative one resolved next to stats0.txt (see sim_start)
+} Simulator;
+
+static void read_options(SimOptions *opt) {
+    const char *limit_env = getenv("SIM_MAX_CYCLES");
+    opt->max_cycles = limit_env ? atoi(limit_env) : -1;
+    opt->debug_branch = getenv("SIM_DEBUG_BRANCH") != NULL;
+    opt->fast_forward = getenv("SIM_NO_FAST_FORWARD") == NULL;
+    const char *trace_format = getenv("SIM_TRACE_FORMAT");
+    opt->binary_trace = trace_format && strcmp(trace_format, "binary") == 0;
+    opt->async_trace = getenv("SIM_TRACE_ASYNC") != NULL;
+    opt->threaded = getenv("SIM_THREADED") != NULL;
+    const char *start_env = getenv("SIM_TRACE_START");
+    const char *stop_env = getenv("SIM_TRACE_STOP");
+    opt->trace_start = start_env ? atoi(start_env) : 0;
+    opt->trace_stop = stop_env ? atoi(stop_env) : INT_MAX;
+    const char *cores_env = getenv("SIM_TRACE_CORES");
+    opt->trace_cores = cores_env ? 0 : 0xFFFFFFFFu;
+    for (const char *p = cores_env; p && *p;) {
+        char *end;
+        long core = strtol(p, &end, 10);
+        if (end == p)
+            break;
+        if (core >= 0 && core < MAX_CORES)
+            opt->trace_cores |= 1u << core;
+        p = *end == ',' ? end + 1 : end;
+    }
+    const char *pc_env = getenv("SIM_TRACE_PC");
+    const char *addr_env = getenv("SIM_TRACE_ADDR");
+    opt->trigger_pc = pc_env ? (int)(strtol(pc_env, NULL, 16) & (IMEM_SIZE - 1)) : -1;
+    opt->trigger_addr = addr_env ? (int)(strtol(addr_env, NULL, 16) & ((1 << 20) - 1)) : -1;
+    const char *last_env = getenv("SIM_TRACE_LAST");
+    opt->trace_last = last_env ? atoi(last_env) : 0;
+    const char *at_env = getenv("SIM_CHECKPOINT_AT");
+    opt->checkpoint_path = getenv("SIM_CHECKPOINT");
+    opt->checkpoint_at = (opt->checkpoint_path && at_env) ? atoi(at_env) : -1;
+    opt->restore_path = getenv("SIM_RESTORE");
+    const char *sample_env = getenv("SIM_SAMPLE");
+    opt->sampled = false;
+    if (sample_env) {
+        if (sscanf(sample_env, "%d,%d,%d", &opt->sample_functional, &opt->sample_warmup, &opt->sample_measure) == 3 &&
+            opt->sample_functional >= 0 && opt->sample_warmup >= 0 && opt->sample_measure > 0)
+            opt->sampled = true;
+        else
+            fprintf(stderr, "SIM_SAMPLE must be F,W,M (functional instructions, warm-up and measured cycles); ignored\n");
+    }
+    opt->sample_cold = getenv("SIM_SAMPLE_COLD") != NULL;
+    opt->superblocks = getenv("SIM_NO_SUPERBLOCKS") == NULL;
+    opt->asm_cache = getenv("SIM_ASM_CACHE");
+    opt->profile_prefix = getenv("SIM_PROFILE");
+    const char *bus_env = getenv("SIM_BUS_STATS");
+    opt->bus_window = bus_env ? atoi(bus_env) : 0;
+    if (bus_env && opt->bus_window <= 0)
+        opt->bus_window = BUS_WINDOW_DEFAULT;
+}
+
+static Simulator *sim_alloc(const MachineConfig *cfg) {
+    Simulator *sim = (Simulator *)calloc(1, sizeof(Simulator));
+    int n = cfg->num_cores;
+    size_t per_core = cache_storage_words(cfg);
+    if (sim) {
+        sim->cores = (Core *)calloc_aligned((size_t)n, sizeof(Core));
+        sim->requests = (BusRequest *)calloc((size_t)n, sizeof(BusRequest));
+        sim->prefetches = (BusRequest *)calloc((size_t)n, sizeof(BusRequest));
+        sim->cache_store = (uint32_t *)calloc((size_t)n * per_core, sizeof(uint32_t));
+    }
+    if (!sim || !sim->cores || !sim->requests || !sim->prefetches || !sim->cache_store) {
+        fprintf(stderr, "Failed to allocate simulator state\n");
+        exit(1);
+    }
+    sim->cfg = *cfg;
+    if (cfg->l2_lines) {
+        sim->l2_store = (uint32_t *)calloc(l2_storage_words(cfg), sizeof(uint32_t));
+        if (!sim->l2_store) {
+            fprintf(stderr, "Failed to allocate simulator state\n");
+            exit(1);
+        }
+        l2_attach(&sim->l2, cfg, sim->l2_store);
+        sim->filter.l2 = &sim->l2; // inclusion makes the L2 the snoop filter
+    } else if (cfg->snoop_filter) {
+        sim->filter.offset_bits = log2_exact(cfg->block_words);
+        sim->filter.sharers = (uint32_t *)calloc((size_t)(MAIN_MEM_WORDS >> sim->filter.offset_bits), sizeof(uint32_t));
+        if (!sim->filter.sharers) {
+            fprintf(stderr, "Failed to allocate simulator state\n");
+            exit(1);
+        }
+    }
+    for (int i = 0; i < n; i++)
+        cache_attach(&sim->cores[i].cache, cfg, sim->cache_store + (size_t)i * per_core);
+    sim->dump_threads = host_cpu_count() - 1;
+    if (sim->dump_threads > DUMP_THREADS_MAX)
+        sim->dump_threads = DUMP_THREADS_MAX;
+    return sim;
+}
+
+static void sim_free(Simulator *sim) {
+    mem_free(&sim->mem);
+    free_aligned(sim->cores);
+    free(sim->requests);
+    free(sim->prefetches);
+    free(sim->cache_store);
+    free(sim->filter.sharers);
+    free(sim->l2_store);
+    free(sim->profile);
+    free(sim->superblocks);
+    if (sim->bus_stats)
+        free(sim->bus_stats->busy);
+    free(sim->bus_stats);
+    free(sim);
+}
+
+static void sim_reset(Simulator *sim) {
+    // Clears all state but keeps the allocated memory pages and cache storage for the next run
+    int n = sim->cfg.num_cores;
+    for (int i = 0; i < n; i++) {
+        Cache cache = sim->cores[i].cache;
+        memset(&sim->cores[i], 0, sizeof(Core));
+        cache.clock = 0;
+        cache.rng = 0x9E3779B9u * (uint32_t)(i + 1);
+        cache.reserved = false;
+        sim->cores[i].cache = cache;
+    }
+    memset(sim->cache_store, 0, (size_t)n * cache_storage_words(&sim->cfg) * sizeof(uint32_t));
+    memset(sim->requests, 0, (size_t)n * sizeof(BusRequest));
+    memset(sim->prefetches, 0, (size_t)n * sizeof(BusRequest));
+    if (sim->filter.sharers)
+        memset(sim->filter.sharers, 0, (size_t)(MAIN_MEM_WORDS >> sim->filter.offset_bits) * sizeof(uint32_t));
+    if (sim->l2_store) {
+        memset(sim->l2_store, 0, l2_storage_words(&sim->cfg) * sizeof(uint32_t));
+        memset(&sim->l2.stats, 0, sizeof(sim->l2.stats));
+        sim->l2.tags.clock = 0;
+        sim->l2.tags.rng = 0x9E3779B9u * (uint32_t)(n + 1);
+    }
+    memset(&sim->bus, 0, sizeof(sim->bus));
+    sim->rr_next = 0;
+    sim->cycle = 0;
+    mem_clear(&sim->mem);
+    read_options(&sim->opt);
+    sim->trace_armed = sim->opt.trigger_pc >= 0 || sim->opt.trigger_addr >= 0;
+    size_t rows = (size_t)n * IMEM_SIZE;
+    if (sim->opt.profile_prefix && !sim->profile)
+        sim->profile = (ProfileRow *)malloc(rows * sizeof(ProfileRow));
+    if (sim->opt.profile_prefix && !sim->profile) {
+        fprintf(stderr, "Failed to allocate profile counters\n");
+        exit(1);
+    }
+    if (sim->profile)
+        memset(sim->profile, 0, rows * sizeof(ProfileRow));
+    if (sim->opt.sampled && sim->opt.superblocks && !sim->superblocks)
+        sim->superblocks = (SuperOp *)malloc(rows * sizeof(SuperOp));
+    if (sim->opt.sampled && sim->opt.superblocks && !sim->superblocks) {
+        fprintf(stderr, "Failed to allocate superblock cache\n");
+        exit(1);
+    }
+    if (sim->opt.bus_window && !sim->bus_stats)
+        sim->bus_stats = (BusStats *)calloc(1, sizeof(BusStats));
+    if (sim->opt.bus_window && !sim->bus_stats) {
+        fprintf(stderr, "Failed to allocate bus statistics\n");
+        exit(1);
+    }
+    if (sim->bus_stats) {
+        BusStats *bs = sim->bus_stats;
+        memset(bs->core, 0, sizeof(bs->core));
+        for (int i = 0; i < MAX_CORES; i++) {
+            bs->core[i].posted = -1;
+            bs->core[i].issued[REQ_MEM] = -1;
+            bs->core[i].issued[REQ_STORE_BUFFER] = -1;
+        }
+        bs->window = sim->opt.bus_window;
+        bs->windows = 0;
+        if (bs->busy)
+            memset(bs->busy, 0, (size_t)bs->capacity * sizeof(uint32_t));
+    }
+}
+
+static void sim_load(Simulator *sim, const char **files) {
+    // file order (see run_file_kinds): imem x N, memin, memout, regout x N, coretrace x N, bustrace,
+    // dsram x N, tsram x N, stats x N. memin goes first so .word data of .asm programs lands on top of it.
+    Core *cores = sim->cores;
+    int n = sim->cfg.num_cores;
+    load_mem(files[run_file_index(RUN_MEMIN, n, 0)], &sim->mem);
+    for (int i = 0; i < n; i++) {
+        cores[i].id = i;
+        const char *imem_path = files[run_file_index(RUN_IMEM, n, i)];
+        if (is_asm_source(imem_path))
+            load_asm(imem_path, cores[i].imem, &sim->mem, sim->opt.asm_cache);
+        else
+            load_imem(imem_path, cores[i].imem);
+        predecode_imem(cores[i].imem, cores[i].prog);
+        cores[i].pc = 0;
+        cores[i].regs[0] = 0;
+        cores[i].regs[1] = 0;
+        trace_open(&cores[i].trace, files[run_file_index(RUN_CORETRACE, n, i)], sim->opt.binary_trace, TRACE_KIND_CORE);
+        trace_window(&cores[i].trace, ((sim->opt.trace_cores >> i) & 1) && !sim->trace_armed ? sim->opt.trace_start : INT_MAX,
+                     sim->opt.trace_stop, sim->opt.trace_last);
+        Instruction first = cores[i].prog[cores[i].pc];
+        PIPE(&cores[i])->fetch.valid = true;
+        PIPE(&cores[i])->fetch.inst = first;
+        if (first.op == OP_HALT)
+            cores[i].stop_fetch = true;
+        cores[i].pc = (cores[i].pc + 1) & (IMEM_SIZE - 1);
+        PIPE(&cores[i])->decode.valid = false;
+        PIPE(&cores[i])->exec.valid = false;
+        PIPE(&cores[i])->mem.valid = false;
+        PIPE(&cores[i])->wb.valid = false;
+    }
+    trace_open(&sim->bus_trace, files[run_file_index(RUN_BUSTRACE, n, 0)], sim->opt.binary_trace, TRACE_KIND_BUS);
+    trace_window(&sim->bus_trace, sim->trace_armed ? INT_MAX : sim->opt.trace_start, sim->opt.trace_stop, sim->opt.trace_last);
+    if (sim->opt.async_trace) {
+        TraceOut *outs[MAX_CORES + 1];
+        for (int i = 0; i < n; i++)
+            outs[i] = &cores[i].trace;
+        outs[n] = &sim->bus_trace;
+        trace_writer_start(&sim->writer, outs, n + 1);
+    }
+}
+
+static void trace_fire(Simulator *sim, int cycle) {
+    // A trigger opens every enabled trace from this cycle on (or from SIM_TRACE_START if that is later)
+    int from = cycle > sim->opt.trace_start ? cycle : sim->opt.trace_start;
+    for (int i = 0; i < sim->cfg.num_cores; i++) {
+        if ((sim->opt.trace_cores >> i) & 1)
+            sim->cores[i].trace.from = from;
+    }
+    sim->bus_trace.from = from;
+    sim->trace_armed = false;
+}
+
+static void trace_check_pc(Simulator *sim, int cycle) {
+    // Fires when a fetch latch holds the PC; `cycle` is the cycle whose core rows show these latches
+    for (int i = 0; i < sim->cfg.num_cores; i++) {
+        const Core *c = &sim->cores[i];
+        if (PIPE(c)->fetch.valid && PIPE(c)->fetch.inst.pc == sim->opt.trigger_pc) {
+            trace_fire(sim, cycle);
+            return;
+        }
+    }
+}
+
+static void trace_check_triggers(Simulator *sim) {
+    // At the end of a cycle: a bus trigger opens the traces on this cycle and writes its bus row now, a PC
+    // trigger opens them on the next cycle
+    const BusState *bus = &sim->bus;
+    uint32_t mask = ~(uint32_t)(sim->cfg.block_words - 1);
+    if (sim->opt.trigger_addr >= 0 && bus->bus_cmd_out != BUS_NONE &&
+        ((bus->bus_addr_out ^ (uint32_t)sim->opt.trigger_addr) & mask) == 0) {
+        trace_fire(sim, sim->cycle);
+        write_bus_trace(&sim->bus_trace, sim->cycle, bus);
+        return;
+    }
+    if (sim->opt.trigger_pc >= 0)
+        trace_check_pc(sim, sim->cycle + 1);
+}
+
+// ---------- Checkpoints ----------
+
+#define CHECKPOINT_MAGIC "SIMCKPT" // 8 bytes with the terminator
+#define CHECKPOINT_VERSION 3
+
+typedef struct {
+    // File header; the structs that follow are raw dumps, so a checkpoint only loads into the same build
+    char magic[8];
+    uint32_t version;
+    uint32_t core_bytes; // sizeof(Core) and sizeof(BusState) of the writing build
+    uint32_t bus_bytes;
+    MachineConfig cfg;
+    int32_t cycle; // last simulated cycle
+    int32_t rr_next;
+    uint32_t high_water;
+    uint32_t pages; // allocated main memory pages that follow, each as page index + MEM_PAGE_WORDS words
+} CheckpointHeader;
+
+static void checkpoint_header(const Simulator *sim, CheckpointHeader *h) {
+    memset(h, 0, sizeof(*h));
+    memcpy(h->magic, CHECKPOINT_MAGIC, sizeof(h->magic));
+    h->version = CHECKPOINT_VERSION;
+    h->core_bytes = (uint32_t)sizeof(Core);
+    h->bus_bytes = (uint32_t)sizeof(BusState);
+    memcpy(&h->cfg, &sim->cfg, sizeof(MachineConfig));
+}
+
+static size_t sharer_words(const Simulator *sim) {
+    return sim->filter.sharers ? (size_t)(MAIN_MEM_WORDS >> sim->filter.offset_bits) : 0;
+}
+
+static void write_checkpoint(const Simulator *sim, const char *path) {
+    // Everything a later cycle depends on: cores (pipeline latches, caches, stats, queues), bus requests,
+    // cache storage, sharer vectors, the L2, bus state and the allocated pages of main memory. Trace files are
+    // not included; a restored run writes fresh ones starting at the next cycle.
+    FILE *fp = fopen(path, "wb");
+    if (!fp) {
+        fprintf(stderr, "Failed to open %s for write\n", path);
+        return;
+    }
+    int n = sim->cfg.num_cores;
+    CheckpointHeader h;
+    checkpoint_header(sim, &h);
+    h.cycle = sim->cycle;
+    h.rr_next = sim->rr_next;
+    h.high_water = sim->mem.high_water;
+    for (uint32_t pg = 0; pg < MEM_PAGES; pg++)
+        h.pages += sim->mem.pages[pg] != NULL;
+    bool ok = fwrite(&h, sizeof(h), 1, fp) == 1;
+    // Each core goes out without what belongs to this process: the cache storage pointers and the trace file,
+    // which restore_checkpoint takes from the restoring run anyway. Equal states then give equal files.
+    Core *snap = (Core *)calloc_aligned(1, sizeof(Core));
+    if (!snap) {
+        fprintf(stderr, "Failed to allocate checkpoint buffer\n");
+        exit(1);
+    }
+    for (int i = 0; ok && i < n; i++) {
+        memcpy(snap, &sim->cores[i], sizeof(Core));
+        snap->cache.data = NULL;
+        snap->cache.tag = NULL;
+        snap->cache.repl = NULL;
+        snap->cache.state = NULL;
+        snap->cache.prefetched = NULL;
+        memset(&snap->trace, 0, sizeof(TraceOut));
+        // The next cycle's latch set is scratch, and fast-forward changes which set is current and what an
+        // empty stage last held, so only valid stages are kept
+        Latches *l = &snap->latch[0];
+        *l = *PIPE(&sim->cores[i]);
+        memset(&snap->latch[1], 0, sizeof(Latches));
+        snap->cur = 0;
+        if (!l->fetch.valid)
+            memset(&l->fetch, 0, sizeof(l->fetch));
+        if (!l->decode.valid)
+            memset(&l->decode, 0, sizeof(l->decode));
+        if (!l->exec.valid)
+            memset(&l->exec, 0, sizeof(l->exec));
+        if (!l->mem.valid)
+            memset(&l->mem, 0, sizeof(l->mem));
+        if (!l->wb.valid)
+            memset(&l->wb, 0, sizeof(l->wb));
+        ok = fwrite(snap, sizeof(Core), 1, fp) == 1;
+    }
+    free_aligned(snap);
+    ok = ok && fwrite(sim->requests, sizeof(BusRequest), (size_t)n, fp) == (size_t)n;
+    ok = ok && fwrite(sim->prefetches, sizeof(BusRequest), (size_t)n, fp) == (size_t)n;
+    size_t store = (size_t)n * cache_storage_words(&sim->cfg);
+    ok = ok && fwrite(sim->cache_store, sizeof(uint32_t), store, fp) == store;
+    size_t sharers = sharer_words(sim);
+    if (sharers) // NULL without -snoop-filter
+        ok = ok && fwrite(sim->filter.sharers, sizeof(uint32_t), sharers, fp) == sharers;
+    if (sim->l2_store) {
+        size_t words = l2_storage_words(&sim->cfg);
+        ok = ok && fwrite(sim->l2_store, sizeof(uint32_t), words, fp) == words;
+        ok = ok && fwrite(&sim->l2.stats, sizeof(L2Stats), 1, fp) == 1;
+        ok = ok && fwrite(&sim->l2.tags.clock, sizeof(uint32_t), 1, fp) == 1 && fwrite(&sim->l2.tags.rng, sizeof(uint32_t), 1, fp) == 1;
+    }
+    ok = ok && fwrite(&sim->bus, sizeof(BusState), 1, fp) == 1;
+    for (uint32_t pg = 0; ok && pg < MEM_PAGES; pg++) {
+        if (!sim->mem.pages[pg])
+            continue;
+        ok = fwrite(&pg, sizeof(pg), 1, fp) == 1 && fwrite(sim->mem.pages[pg], sizeof(uint32_t), MEM_PAGE_WORDS, fp) == MEM_PAGE_WORDS;
+    }
+    if (fclose(fp) != 0 || !ok)
+        fprintf(stderr, "Failed to write checkpoint %s\n", path);
+}
+
+static void read_exact(FILE *fp, void *dst, size_t size, size_t count, const char *path) {
+    if (fread(dst, size, count, fp) != count) {
+        fprintf(stderr, "%s: truncated checkpoint\n", path);
+        exit(1);
+    }
+}
+
+static void restore_checkpoint(Simulator *sim, const char *path) {
+    // Replaces the loaded program and memory image with the saved state; the cache storage and trace files
+    // of this run stay attached to the restored cores
+    FILE *fp = fopen(path, "rb");
+    if (!fp) {
+        fprintf(stderr, "Failed to open %s\n", path);
+        exit(1);
+    }
+    CheckpointHeader h, expect;
+    checkpoint_header(sim, &expect);
+    read_exact(fp, &h, sizeof(h), 1, path);
+    if (memcmp(h.magic, expect.magic, sizeof(h.magic)) != 0 || h.version != expect.version ||
+        h.core_bytes != expect.core_bytes || h.bus_bytes != expect.bus_bytes) {
+        fprintf(stderr, "%s is not a checkpoint of this simulator build\n", path);
+        exit(1);
+    }
+    if (memcmp(&h.cfg, &expect.cfg, sizeof(MachineConfig)) != 0) {
+        fprintf(stderr, "%s was written with different machine flags\n", path);
+        exit(1);
+    }
+    int n = sim->cfg.num_cores;
+    for (int i = 0; i < n; i++) {
+        Core *c = &sim->cores[i];
+        Cache cache = c->cache;
+        TraceOut trace = c->trace;
+        read_exact(fp, c, sizeof(Core), 1, path);
+        cache.clock = c->cache.clock;
+        cache.rng = c->cache.rng;
+        cache.reserved = c->cache.reserved;
+        cache.reserved_block = c->cache.reserved_block;
+        c->cache = cache;
+        c->trace = trace;
+    }
+    read_exact(fp, sim->requests, sizeof(BusRequest), (size_t)n, path);
+    read_exact(fp, sim->prefetches, sizeof(BusRequest), (size_t)n, path);
+    read_exact(fp, sim->cache_store, sizeof(uint32_t), (size_t)n * cache_storage_words(&sim->cfg), path);
+    if (sharer_words(sim))
+        read_exact(fp, sim->filter.sharers, sizeof(uint32_t), sharer_words(sim), path);
+    if (sim->l2_store) {
+        read_exact(fp, sim->l2_store, sizeof(uint32_t), l2_storage_words(&sim->cfg), path);
+        read_exact(fp, &sim->l2.stats, sizeof(L2Stats), 1, path);
+        read_exact(fp, &sim->l2.tags.clock, sizeof(uint32_t), 1, path);
+        read_exact(fp, &sim->l2.tags.rng, sizeof(uint32_t), 1, path);
+    }
+    read_exact(fp, &sim->bus, sizeof(BusState), 1, path);
+    mem_clear(&sim->mem);
+    for (uint32_t k = 0; k < h.pages; k++) {
+        uint32_t pg;
+        read_exact(fp, &pg, sizeof(pg), 1, path);
+        if (pg >= MEM_PAGES) {
+            fprintf(stderr, "%s: bad memory page %u\n", path, pg);
+            exit(1);
+        }
+        read_exact(fp, mem_page(&sim->mem, pg * MEM_PAGE_WORDS), sizeof(uint32_t), MEM_PAGE_WORDS, path);
+    }
+    fclose(fp);
+    sim->mem.high_water = h.high_water;
+    sim->rr_next = h.rr_next;
+    sim->cycle = h.cycle + 1;
+}
+
+// ---------- Main simulation logic ----------
+
+static NOINLINE bool vector_access(Simulator *sim, Core *c, MemStage *next_mem, WbStage *next_wb, ProfileRow *profile) {
+    // vlw/vsw in MEM: every lane whose line is present (and writable, for vsw) is done this cycle; the first
+    // missing one requests its block and the rest wait, so lanes may span blocks. Hit or miss is counted once,
+    // on the first attempt. Returns whether the instruction retired to WB.
+    const MemStage *m = &PIPE(c)->mem;
+    const Instruction *inst = &m->inst;
+    bool store = m->is_store;
+    uint8_t done = m->lanes_done;
+    int missing = -1;
+    for (int k = 0; k < VEC_LANES; k++) {
+        if ((done >> k) & 1)
+            continue;
+        uint32_t addr = m->alu_result + (uint32_t)k;
+        if (c->fill_pending && block_of(&c->cache, addr) == c->fill_block)
+            continue; // still filling; its last beat finishes the lane
+        int slot = cache_lookup(&c->cache, addr);
+        if (slot < 0 || (store && c->cache.state[slot] == MESI_S)) {
+            if (missing < 0)
+                missing = k;
+            continue;
+        }
+        cache_touch(&c->cache, slot);
+        if (store) {
+            cache_write(&c->cache, slot, addr, m->lanes[k]);
+            if (c->cache.state[slot] == MESI_E)
+                c->cache.state[slot] = MESI_M;
+        } else {
+            next_mem->lanes[k] = cache_read(&c->cache, slot, addr);
+        }
+        done |= (uint8_t)(1u << k);
+    }
+    bool complete = done == (1u << VEC_LANES) - 1;
+    if (!m->miss) {
+        if (complete) {
+            if (store)
+                c->stats.write_hit++;
+            else
+                c->stats.read_hit++;
+        } else {
+            if (store)
+                c->stats.write_miss++;
+            else
+                c->stats.read_miss++;
+            if (profile) {
+                ProfileRow *row = profile_row(profile, c, inst->pc);
+                if (store)
+                    row->write_miss++;
+                else
+                    row->read_miss++;
+            }
+        }
+        if (sim->cfg.prefetch != PREFETCH_NONE)
+            prefetch_train(c, sim->cfg.prefetch, inst->pc, m->alu_result, !complete);
+    }
+    next_mem->lanes_done = done;
+    if (complete) {
+        next_wb->valid = true;
+        next_wb->inst = *inst;
+        next_wb->value = 0;
+        memcpy(next_wb->lanes, next_mem->lanes, sizeof(next_wb->lanes));
+        next_mem->valid = false;
+        return true;
+    }
+    next_mem->miss = true;
+    BusRequest *req = &sim->requests[c->id];
+    uint32_t addr = m->alu_result + (uint32_t)missing;
+    if (missing >= 0 && !req->active && !own_block_busy(c, block_of(&c->cache, addr))) {
+        // the request slot may be held by the store buffer; if so retry next cycle
+        req->active = true;
+        req->cmd = store ? BUS_RDX : BUS_RD;
+        req->addr = addr;
+        req->origin = c->id;
+        req->source = REQ_MEM;
+        next_mem->mem_addr = addr; // the fill of this block ends the wait (see complete_transaction)
+        next_mem->waiting = true;
+    }
+    c->stats.mem_stall++;
+    return false;
+}
+
+static void core_step(Simulator *sim, Core *c, int cycle) {
+    // One cycle of a single core; touches only the core itself and its requests[] slot.
+    // Stages read the Q latches in q and write the D latches in d, which become PIPE(c) at the end.
+    Latches *q = PIPE(c);
+    Latches *d = &c->latch[c->cur ^ 1];
+    // trace before state changes (Q state of pipeline latches)
+    write_core_trace(cycle, c);
+
+    // WB stage: commit register writes and mark HALT retirement
+    ProfileRow *profile = sim->profile;
+    if (q->wb.valid) {
+        int dst = q->wb.inst.dst;
+        if (q->wb.inst.dst2 >= 0)
+            c->regs[q->wb.inst.dst2] = q->wb.value2;
+        if (dst >= 0)
+            c->regs[dst] = q->wb.value;
+        else if (q->wb.inst.op == OP_VLW)
+            for (int k = 0; k < VEC_LANES && q->wb.inst.rd + k < 16; k++)
+                if (q->wb.inst.rd + k > 1)
+                    c->regs[q->wb.inst.rd + k] = q->wb.lanes[k];
+        c->stats.instructions++;
+        if (profile)
+            profile_row(profile, c, q->wb.inst.pc)->retired++;
+        if (q->wb.inst.op == OP_HALT)
+            c->halted = true;
+    }
+
+    // pipeline advance (simulate combinational logic for next cycle)
+    if (!c->done)
+        c->stats.cycles++;
+
+    // store buffer drains ahead of MEM, so its oldest store gets the request slot first
+    if (sim->cfg.store_buffer)
+        drain_store_buffer(c, &sim->requests[c->id], profile);
+    if (sim->cfg.prefetch != PREFETCH_NONE && !c->done)
+        issue_prefetch(c, &sim->prefetches[c->id]);
+
+    // MEM carries most of its latch over while it waits; the other stages copy theirs only when they hold
+    d->wb.valid = false;
+    d->mem = q->mem;
+
+    bool mem_advances = false;
+
+    // MEM stage: handle cache access, misses enqueue bus requests
+    if (q->mem.valid) {
+        if (q->mem.waiting) {
+            // Waiting for bus transaction to complete
+            c->stats.mem_stall++;
+            mem_advances = false;
+        } else {
+            Instruction *inst = &q->mem.inst;
+            uint32_t block = q->mem.mem_addr & ((1 << 20) - 1) & ~(uint32_t)(c->cache.geo.block_words - 1);
+            if (q->mem.word_ready) {
+                // critical-word-first: retire on the early word while the block keeps filling
+                d->mem.word_ready = false;
+                d->wb.valid = true;
+                d->wb.inst = *inst;
+                d->wb.value = q->mem.load_value;
+                d->mem.valid = false;
+                mem_advances = true;
+            } else if (c->fill_pending && (q->mem.is_load || q->mem.is_store) && block == c->fill_block) {
+                // the line is still being filled; wait for its last beat
+                c->stats.mem_stall++;
+                c->stats.fill_stall++;
+                mem_advances = false;
+            } else if ((inst->op == OP_LL || inst->op == OP_SC || inst->op == OP_VLW || inst->op == OP_VSW) && c->sb.count) {
+                // ll, sc and the vector accesses go to the cache directly, after every older buffered store
+                c->stats.mem_stall++;
+                mem_advances = false;
+            } else if (inst->op == OP_SC && !reservation_holds(&c->cache, q->mem.mem_addr)) {
+                // the reservation is gone: nothing is stored and the bus is not used
+                c->cache.reserved = false;
+                c->stats.sc_fail++;
+                d->wb.valid = true;
+                d->wb.inst = *inst;
+                d->wb.value = 0;
+                d->mem.valid = false;
+                mem_advances = true;
+            } else if (inst->op == OP_VLW || inst->op == OP_VSW) {
+                mem_advances = vector_access(sim, c, &d->mem, &d->wb, profile);
+            } else if (inst->op == OP_SW && sim->cfg.store_buffer) {
+                // retire into the store buffer; hit/miss is counted when the entry drains
+                if (c->sb.count < sim->cfg.store_buffer) {
+                    store_buffer_push(&c->sb, q->mem.mem_addr, q->mem.store_data, inst->pc);
+                    if (sim->cfg.prefetch != PREFETCH_NONE)
+                        prefetch_train(c, sim->cfg.prefetch, inst->pc, q->mem.mem_addr,
+                                       cache_lookup(&c->cache, q->mem.mem_addr) < 0);
+                    d->wb.valid = true;
+                    d->wb.inst = *inst;
+                    d->wb.value = 0;
+                    d->mem.valid = false;
+                    mem_advances = true;
+                } else {
+                    c->stats.mem_stall++;
+                    c->stats.sb_full_stall++;
+                    mem_advances = false;
+                }
+            } else if ((inst->op == OP_LW || inst->op == OP_LWPI) && c->sb.count &&
+                       store_buffer_lookup(&c->sb, q->mem.mem_addr, &d->mem.load_value)) {
+                c->stats.sb_forward++;
+                d->wb.valid = true;
+                d->wb.inst = *inst;
+                d->wb.value = d->mem.load_value;
+                d->mem.valid = false;
+                mem_advances = true;
+            } else if (q->mem.is_load || q->mem.is_store) {
+                bool counted = q->mem.miss;
+                int slot = cache_lookup(&c->cache, q->mem.mem_addr);
+                bool hit = slot >= 0;
+                int state = hit ? c->cache.state[slot] : MESI_I;
+                if (!counted) {
+                    if (hit && state != MESI_I) {
+                        if (q->mem.is_load)
+                            c->stats.read_hit++;
+                        else
+                            c->stats.write_hit++;
+                    } else {
+                        if (q->mem.is_load)
+                            c->stats.read_miss++;
+                        else
+                            c->stats.write_miss++;
+                        if (profile) {
+                            ProfileRow *row = profile_row(profile, c, inst->pc);
+                            if (q->mem.is_load)
+                                row->read_miss++;
+                            else
+                                row->write_miss++;
+                        }
+                        if (c->pf.inflight && c->pf.inflight_block == block)
+                            c->stats.prefetch_late++;
+                    }
+                    if (sim->cfg.prefetch != PREFETCH_NONE) {
+                        bool used = hit && prefetch_note_use(c, slot);
+                        prefetch_train(c, sim->cfg.prefetch, inst->pc, q->mem.mem_addr, !hit || used);
+                    }
+                }
+
+                if (!hit || state == MESI_I || (q->mem.is_store && state == MESI_S)) {
+                    // the request slot may be held by the store buffer; if so retry next cycle
+                    if (!q->mem.request_queued && !sim->requests[c->id].active && !own_block_busy(c, block)) {
+                        sim->requests[c->id].active = true;
+                        sim->requests[c->id].cmd = q->mem.is_load ? BUS_RD : BUS_RDX;
+                        sim->requests[c->id].addr = q->mem.mem_addr & ((1 << 20) - 1);
+                        sim->requests[c->id].origin = c->id;
+                        sim->requests[c->id].source = REQ_MEM;
+                        q->mem.request_queued = true;
+                    }
+                    d->mem.miss = true;
+                    d->mem.waiting = q->mem.request_queued;
+                    c->stats.mem_stall++;
+                    mem_advances = false;
+                } else {
+                    cache_touch(&c->cache, slot);
+                    if (q->mem.is_load) {
+                        d->mem.load_value = cache_read(&c->cache, slot, q->mem.mem_addr);
+                        if (inst->op == OP_LL) {
+                            c->cache.reserved = true;
+                            c->cache.reserved_block = block;
+                        }
+                        d->wb.valid = true;
+                        d->wb.inst = *inst;
+                        d->wb.value = d->mem.load_value;
+                        d->mem.valid = false;
+                        mem_advances = true;
+                    } else {
+                        cache_write(&c->cache, slot, q->mem.mem_addr, q->mem.store_data);
+                        if (state == MESI_E)
+                            c->cache.state[slot] = MESI_M;
+                        d->wb.valid = true;
+                        d->wb.inst = *inst;
+                        d->wb.value = 0;
+                        if (inst->op == OP_SC) {
+                            c->cache.reserved = false;
+                            c->stats.sc_success++;
+                            d->wb.value = 1;
+                        }
+                        d->mem.valid = false;
+                        mem_advances = true;
+                    }
+                }
+            } else {
+                d->wb.valid = true;
+                d->wb.inst = *inst;
+                d->wb.value = q->mem.alu_result;
+                d->mem.valid = false;
+                mem_advances = true;
+            }
+        }
+    }
+
+    d->wb.value2 = q->mem.alu_result; // lwpi's advanced base, whichever way it retired
+
+    // every cycle MEM holds its instruction is a mem_stall above
+    if (profile && q->mem.valid && !mem_advances)
+        profile_row(profile, c, q->mem.inst.pc)->mem_stall++;
+
+    bool forwarding = sim->cfg.forwarding;
+    bool mem_free_next = (!q->mem.valid) || mem_advances;
+    bool exec_can_move = q->exec.valid && mem_free_next;
+    if (exec_can_move && forwarding && load_use_hazard(c)) {
+        exec_can_move = false;
+        c->stats.load_use_stall++;
+        if (profile)
+            profile_row(profile, c, q->exec.inst.pc)->load_use_stall++;
+    }
+    bool exec_free_next = (!q->exec.valid) || exec_can_move;
+    if (exec_free_next)
+        d->exec.valid = false; // unless decode moves into it below
+    else
+        d->exec = q->exec;
+
+    // EXEC stage: execute ALU or compute addresses, then hand to MEM
+    if (q->exec.valid && exec_can_move) {
+        Instruction *inst = &q->exec.inst;
+        int32_t rs_val = q->exec.rs_val;
+        int32_t rt_val = q->exec.rt_val;
+        int32_t rd_val = q->exec.rd_val;
+        if (forwarding) {
+            rs_val = forward_operand(c, inst->rs, rs_val);
+            rt_val = forward_operand(c, inst->rt, rt_val);
+            rd_val = forward_operand(c, inst->rd, rd_val);
+        }
+        d->mem.valid = true;
+        d->mem.inst = *inst;
+        d->mem.waiting = false;
+        d->mem.request_queued = false;
+        d->mem.miss = false;
+        d->mem.load_value = 0;
+        d->mem.alu_result = 0;
+        if (inst->kind >= KIND_LW && inst->kind <= KIND_VSW) {
+            uint32_t addr = (uint32_t)(rs_val + rt_val);
+            if (inst->kind == KIND_LWPI) {
+                d->mem.alu_result = addr; // the advanced base
+                addr = (uint32_t)rs_val;
+            } else if (inst->kind >= KIND_VLW) {
+                addr &= ~(uint32_t)(VEC_LANES - 1);
+                d->mem.alu_result = addr & ((1 << 20) - 1);
+                d->mem.lanes_done = 0;
+                for (int k = 0; inst->kind == KIND_VSW && k < VEC_LANES; k++)
+                    d->mem.lanes[k] = (uint32_t)lane_operand(c, inst, inst->rd + k, forwarding);
+            }
+            d->mem.mem_addr = addr & ((1 << 20) - 1);
+            d->mem.store_data = rd_val;
+            d->mem.is_load = inst->kind == KIND_LW || inst->kind == KIND_LL || inst->kind == KIND_LWPI || inst->kind == KIND_VLW;
+            d->mem.is_store = inst->kind == KIND_SW || inst->kind == KIND_SC || inst->kind == KIND_VSW;
+        } else {
+            d->mem.is_load = d->mem.is_store = false;
+            d->mem.alu_result = perform_alu(inst, rs_val, rt_val, rd_val);
+        }
+    }
+
+    // DECODE stage: hazard detection + branch resolution
+    bool decode_has_inst = q->decode.valid;
+    bool decode_stall = false;
+    if (decode_has_inst) {
+        c->regs[1] = q->decode.inst.imm;
+        decode_stall = decode_hazard(c, forwarding);
+        if (!exec_free_next)
+            decode_stall = true;
+        if (decode_stall) {
+            c->stats.decode_stall++;
+            if (profile)
+                profile_row(profile, c, q->decode.inst.pc)->decode_stall[decode_stall_stage(c, forwarding)]++;
+        }
+    }
+
+    bool decode_moves = decode_has_inst && !decode_stall && exec_free_next;
+    bool decode_free_next = (!q->decode.valid) || decode_moves;
+    bool fetch_moves = q->fetch.valid && decode_free_next;
+
+    if (decode_moves) {
+        Instruction *inst = &q->decode.inst;
+        if (forwarding)
+            c->stats.forwarded += (uint32_t)popcount16(inst->src_mask & pending_writes(c));
+        d->exec.valid = true;
+        d->exec.inst = *inst;
+        d->exec.rs_val = c->regs[inst->rs];
+        d->exec.rt_val = c->regs[inst->rt];
+        d->exec.rd_val = c->regs[inst->rd];
+
+        // Branch/jump resolve in decode; delay slot is the following instruction already in fetch
+        if (inst->op >= OP_BEQ && inst->op <= OP_BGE) {
+            bool taken = perform_compare(inst, d->exec.rs_val, d->exec.rt_val);
+            if (sim->opt.debug_branch && c->id == 3) {
+                fprintf(stderr, "cycle %d core%d branch pc %03X rs=%08X rt=%08X taken=%d target=%03X\n",
+                        cycle, c->id, inst->pc & 0x3FF, (uint32_t)d->exec.rs_val, (uint32_t)d->exec.rt_val,
+                        taken, c->regs[inst->rd] & 0x3FF);
+            }
+            if (taken) {
+                c->redirect_pending = true;
+                c->redirect_pc = c->regs[inst->rd] & 0x3FF;
+            }
+        } else if (inst->op == OP_JAL) {
+            c->redirect_pending = true;
+            c->redirect_pc = c->regs[inst->rd] & 0x3FF;
+        }
+
+        // R1 always mirrors the current instruction immediate (decoded in this cycle)
+        c->regs[1] = inst->imm;
+        d->decode.valid = false;
+    } else if (!decode_stall) {
+        d->decode.valid = false;
+    } else {
+        d->decode = q->decode;
+    }
+
+    if (fetch_moves) {
+        d->decode.valid = true;
+        d->decode.inst = q->fetch.inst;
+    }
+
+    // FETCH stage: pull next instruction unless halted, draining or decode is blocked
+    bool drained = c->drain && !is_control(&c->prog[(c->pc - 1) & (IMEM_SIZE - 1)]); // delay slots still come in
+    if (!c->stop_fetch && !drained && decode_free_next) {
+        if (c->redirect_pending) {
+            // branch/jump taken: fetch target while delay slot advances
+            d->fetch.valid = true;
+            d->fetch.inst = c->prog[c->redirect_pc];
+            c->pc = (c->redirect_pc + 1) & (IMEM_SIZE - 1);
+            c->redirect_pending = false;
+        } else {
+            const Instruction *inst = &c->prog[c->pc];
+            d->fetch.valid = true;
+            d->fetch.inst = *inst;
+            if (inst->op == OP_HALT)
+                c->stop_fetch = true;
+            c->pc = (c->pc + 1) & (IMEM_SIZE - 1);
+        }
+    } else if (fetch_moves) {
+        d->fetch.valid = false;
+    } else {
+        d->fetch = q->fetch;
+    }
+
+    c->cur ^= 1;
+
+    // Bus statistics: the cycle the demand request went active, taken from the core's own cycle because the
+    // threaded engine replays the bus only after the cores have run a whole window
+    BusStats *bs = sim->bus_stats;
+    if (bs && sim->requests[c->id].active && bs->core[c->id].posted < 0)
+        bs->core[c->id].posted = cycle;
+
+    bool any_valid = d->fetch.valid || d->decode.valid || d->exec.valid || d->mem.valid || d->wb.valid;
+    if (c->halted && !any_valid && c->sb.count == 0)
+        c->done = true;
+}
+
+static bool block_in_flight(const BusState *bus, uint32_t addr, int block_words) {
+    // Split bus: at most one outstanding transaction per block, so snoops never race an unfinished fill
+    uint32_t block = addr & ~(uint32_t)(block_words - 1);
+    if (bus->phase == 2 && (bus->addr & ~(uint32_t)(block_words - 1)) == block)
+        return true;
+    for (int q = 0; q < bus->queued; q++) {
+        if ((bus->queue[q].addr & ~(uint32_t)(block_words - 1)) == block)
+            return true;
+    }
+    return false;
+}
+
+static int arbitrate(Simulator *sim, bool split, BusRequest *req) {
+    // Round-robin over demand requests; a prefetch wins only when no demand request can go this cycle.
+    // Copies the winner into req, frees its slot and returns its core, or -1 if nothing is granted.
+    int n = sim->cfg.num_cores;
+    BusRequest *slots[2] = {sim->requests, sim->prefetches};
+    int classes = sim->cfg.prefetch != PREFETCH_NONE ? 2 : 1;
+    for (int cls = 0; cls < classes; cls++) {
+        for (int k = 0, idx = sim->rr_next; k < n; k++, idx = (idx + 1 == n) ? 0 : idx + 1) {
+            BusRequest *r = &slots[cls][idx];
+            if (!r->active || (split && block_in_flight(&sim->bus, r->addr, sim->cfg.block_words)))
+                continue;
+            if (cls == 0)
+                sim->rr_next = (idx + 1 == n) ? 0 : idx + 1;
+            *req = *r;
+            r->active = false;
+            return idx;
+        }
+    }
+    return -1;
+}
+
+static void bus_step(Simulator *sim) {
+    // Arbitration, bus outputs and timing for one cycle; runs after every core has stepped
+    BusState *bus = &sim->bus;
+
+    BusStats *bs = sim->bus_stats;
+
+    // start bus transaction if idle
+    if (bus->phase == 0) {
+        BusRequest req;
+        uint32_t invalidated;
+        // Round-robin winner starts transaction; others will retry next cycle
+        if (arbitrate(sim, false, &req) >= 0) {
+            start_bus_transaction(bus, &req, &sim->cfg, sim->cores, &sim->mem, &sim->filter, &invalidated);
+            if (bs)
+                bus_stats_grant(bs, &req, bus->provider, sim->cfg.num_cores, invalidated, sim->cycle);
+        }
+    }
+
+    // determine bus output for this cycle (flush beats waiting)
+    if (bus->phase == 2) {
+        drive_flush_beat(bus, &sim->cfg, sim->cores);
+    } else if (bus->phase == 1 && bus->delay == 0 && bus->bus_cmd_out == BUS_NONE) {
+        bus->phase = 2;
+        bus->index = 0;
+        drive_flush_beat(bus, &sim->cfg, sim->cores);
+    }
+
+    write_bus_trace(&sim->bus_trace, sim->cycle, bus);
+    if (bs)
+        bus_stats_cycle(bs, bus, sim->cycle);
+
+    // advance bus state (latency countdown or streaming flush)
+    if (bus->phase == 1 && bus->delay > 0) {
+        bus->delay--;
+    } else if (bus->phase == 2 && bus->bus_cmd_out == BUS_FLUSH) {
+        bus->index++;
+        if (bus->index >= sim->cfg.block_words) {
+            if (bs)
+                bus_stats_complete(bs, bus, sim->cycle);
+            complete_transaction(bus, &sim->cfg, sim->cores, &sim->mem, &sim->filter);
+            bus->phase = 0;
+            bus->cmd = BUS_NONE;
+        }
+    }
+}
+
+static void bus_step_split(Simulator *sim) {
+    // Split-transaction bus: a granted request waits at the memory controller while the bus carries other
+    // commands and flush beats. Each cycle the bus carries one flush beat or one command; data has priority.
+    BusState *bus = &sim->bus;
+    const MachineConfig *cfg = &sim->cfg;
+    BusStats *bs = sim->bus_stats;
+
+    // start the oldest response whose data is ready
+    if (bus->phase == 0) {
+        for (int q = 0; q < bus->queued; q++) {
+            const BusTransaction *t = &bus->queue[q];
+            if (t->ready > sim->cycle)
+                continue;
+            bus->cmd = t->cmd;
+            bus->origin = t->origin;
+            bus->source = t->source;
+            bus->addr = t->addr;
+            bus->shared = t->shared;
+            bus->provider = t->provider;
+            memcpy(bus->block, t->block, (size_t)cfg->block_words * sizeof(uint32_t));
+            bus->index = 0;
+            bus->phase = 2;
+            memmove(&bus->queue[q], &bus->queue[q + 1], (size_t)(bus->queued - q - 1) * sizeof(BusTransaction));
+            bus->queued--;
+            break;
+        }
+    }
+
+    if (bus->phase == 2) {
+        drive_flush_beat(bus, cfg, sim->cores);
+    } else if (bus->queued < cfg->bus_queue) {
+        // free cycle: round-robin grant among requests whose block is not already in flight
+        BusRequest req;
+        if (arbitrate(sim, true, &req) >= 0) {
+            BusTransaction *t = &bus->queue[bus->queued++];
+            uint32_t invalidated;
+            int delay = snoop_request(&req, cfg, sim->cores, &sim->mem, &sim->filter, t, &invalidated);
+            t->ready = sim->cycle + (delay > 0 ? delay : 1); // same flush start as the atomic bus
+            drive_bus_command(bus, &req, t->shared);
+            if (bs)
+                bus_stats_grant(bs, &req, t->provider, cfg->num_cores, invalidated, sim->cycle);
+        }
+    }
+
+    write_bus_trace(&sim->bus_trace, sim->cycle, bus);
+    if (bs)
+        bus_stats_cycle(bs, bus, sim->cycle);
+
+    if (bus->phase == 2) {
+        bus->index++;
+        if (bus->index >= cfg->block_words) {
+            if (bs)
+                bus_stats_complete(bs, bus, sim->cycle);
+            complete_transaction(bus, cfg, sim->cores, &sim->mem, &sim->filter);
+            bus->phase = 0;
+            bus->cmd = BUS_NONE;
+        }
+    }
+}
+
+static int pause_cycle(const Simulator *sim) {
+    // Next cycle the run loops must end a step on exactly (SIM_MAX_CYCLES or a pending checkpoint), -1 if none
+    int limit = sim->opt.max_cycles;
+    int at = sim->opt.checkpoint_at;
+    if (at >= sim->cycle && (limit < 0 || at < limit))
+        limit = at;
+    return limit;
+}
+
+static void sim_fast_forward(Simulator *sim) {
+    // While memory latency counts down and every core is parked behind the bus, nothing but counters
+    // and trace cycle numbers change, so those cycles are applied in bulk up to the flush start.
+    BusState *bus = &sim->bus;
+    if (!sim->opt.fast_forward || sim->cfg.bus_queue > 0 || bus->phase != 1 || bus->delay <= 0)
+        return;
+    for (int i = 0; i < sim->cfg.num_cores; i++) {
+        if (!core_frozen(&sim->cores[i], sim->cfg.forwarding))
+            return;
+    }
+    int skip = bus->delay;
+    int limit = pause_cycle(sim);
+    if (limit >= 0 && sim->cycle + skip > limit)
+        skip = limit - sim->cycle;
+    if (skip <= 0)
+        return;
+    for (int i = 0; i < sim->cfg.num_cores; i++)
+        fast_forward_core(&sim->cores[i], sim->cycle, skip, sim->profile, sim->cfg.forwarding);
+    bus->delay -= skip;
+    sim->cycle += skip;
+}
+
+static bool sim_stop_after_cycle(const Simulator *sim) {
+    // Completion/timeout check at the end of sim->cycle
+    if (sim->opt.max_cycles >= 0 && sim->cycle >= sim->opt.max_cycles)
+        return true;
+    for (int i = 0; i < sim->cfg.num_cores; i++) {
+        if (!sim->cores[i].done)
+            return false;
+    }
+    return sim->bus.phase == 0 && sim->bus.queued == 0;
+}
+
+static void sim_cycle(Simulator *sim) {
+    // Steps 1-5 of one cycle
+    reset_bus_out(&sim->bus);
+    for (int i = 0; i < sim->cfg.num_cores; i++)
+        core_step(sim, &sim->cores[i], sim->cycle);
+    if (sim->cfg.bus_queue > 0)
+        bus_step_split(sim);
+    else
+        bus_step(sim);
+    if (sim->trace_armed)
+        trace_check_triggers(sim);
+}
+
+static void sim_run(Simulator *sim) {
+    // Cycle order:
+    // 1) Capture traces for current latch contents
+    // 2) Commit WB writes
+    // 3) Compute next-state for all pipeline stages (no forwarding)
+    // 4) Arbitrate bus requests and drive bus outputs
+    // 5) Advance bus timing (flush/latency)
+    // 6) Check for completion/timeout
+    // Steps 1-3 only touch the core being stepped, so they run core by core.
+    while (1) {
+        sim_fast_forward(sim);
+
+        sim_cycle(sim);
+
+        if (sim->cycle == sim->opt.checkpoint_at)
+            write_checkpoint(sim, sim->checkpoint_path);
+        if (sim_stop_after_cycle(sim))
+            break;
+        sim->cycle++;
+    }
+}
+
+// ---------- Threaded engine ----------
+
+typedef struct {
+    // Generation-counting spin barrier; waiters yield after spin_limit polls (0 when the host has fewer CPUs than parties)
+    volatile uint32_t arrived;
+    volatile uint32_t generation;
+    uint32_t parties;
+    int spin_limit;
+} SpinBarrier;
+
+static void barrier_wait(SpinBarrier *b) {
+    uint32_t gen = atomic_load_u32(&b->generation);
+    if (atomic_fetch_add_u32(&b->arrived, 1) + 1 == b->parties) {
+        atomic_store_u32(&b->arrived, 0);
+        atomic_store_u32(&b->generation, gen + 1);
+        return;
+    }
+    for (int spins = 0; atomic_load_u32(&b->generation) == gen; spins++) {
+        if (spins >= b->spin_limit)
+            thread_yield();
+    }
+}
+
+typedef struct {
+    // A window of `count` cycles starting at `first`, stepped by every core thread between two barriers
+    Simulator *sim;
+    SpinBarrier barrier;
+    int first;
+    int count; // 0 tells the core threads to exit
+} ThreadedEngine;
+
+typedef struct {
+    ThreadedEngine *eng;
+    int core;
+} CoreThread;
+
+static int independent_cycles(const Simulator *sim) {
+    // Cycles, starting now, in which bus_step cannot touch core state: while a transaction sits in its memory
+    // latency or flush beats nothing is arbitrated or snooped, and the fill lands in the last beat's bus step.
+    const BusState *bus = &sim->bus;
+    int k = 1;
+    if (sim->cfg.bus_queue > 0 || sim->cfg.critical_word_first)
+        return 1; // split bus grants (and snoops) in any cycle; critical-word-first restarts a core mid-flush
+    if (sim->trace_armed)
+        return 1; // a trigger opens every trace at once, so cores must not run ahead of it
+    if (bus->phase == 1)
+        k = bus->delay + sim->cfg.block_words;
+    else if (bus->phase == 2)
+        k = sim->cfg.block_words - bus->index;
+    int limit = pause_cycle(sim);
+    if (limit >= 0 && sim->cycle + k - 1 > limit)
+        k = limit - sim->cycle + 1;
+    return k > 0 ? k : 1;
+}
+
+static void step_core_window(ThreadedEngine *eng, int core) {
+    Core *c = &eng->sim->cores[core];
+    for (int k = 0; k < eng->count; k++)
+        core_step(eng->sim, c, eng->first + k);
+}
+
+static void core_thread_main(void *arg) {
+    CoreThread *t = (CoreThread *)arg;
+    ThreadedEngine *eng = t->eng;
+    while (1) {
+        barrier_wait(&eng->barrier); // window published
+        if (eng->count == 0)
+            break;
+        step_core_window(eng, t->core);
+        barrier_wait(&eng->barrier); // window stepped
+    }
+}
+
+static void sim_run_threaded(Simulator *sim) {
+    // Core 0 runs on the calling thread, which also replays the bus serially over each window.
+    // Every core sees exactly the per-cycle inputs it gets in sim_run, so the outputs are byte-identical.
+    ThreadedEngine eng;
+    memset(&eng, 0, sizeof(eng));
+    eng.sim = sim;
+    int n = sim->cfg.num_cores;
+    eng.barrier.parties = (uint32_t)n;
+    eng.barrier.spin_limit = host_cpu_count() >= n ? 1000 : 0;
+    CoreThread workers[MAX_CORES];
+    SimThread threads[MAX_CORES];
+    for (int i = 1; i < n; i++) {
+        workers[i].eng = &eng;
+        workers[i].core = i;
+        thread_start(&threads[i], core_thread_main, &workers[i]);
+    }
+
+    while (1) {
+        sim_fast_forward(sim);
+
+        eng.first = sim->cycle;
+        eng.count = independent_cycles(sim);
+        barrier_wait(&eng.barrier);
+        step_core_window(&eng, 0);
+        barrier_wait(&eng.barrier);
+
+        // The window ends on the only cycle that can finish the run (bus idle again, or max_cycles) or take a
+        // checkpoint
+        bool stop = false;
+        for (int k = 0; k < eng.count && !stop; k++) {
+            sim->cycle = eng.first + k;
+            reset_bus_out(&sim->bus);
+            if (sim->cfg.bus_queue > 0)
+                bus_step_split(sim);
+            else
+                bus_step(sim);
+            if (sim->trace_armed)
+                trace_check_triggers(sim);
+            stop = sim_stop_after_cycle(sim);
+        }
+        if (sim->cycle == sim->opt.checkpoint_at)
+            write_checkpoint(sim, sim->checkpoint_path);
+        if (stop)
+            break;
+        sim->cycle++;
+    }
+
+    eng.count = 0;
+    barrier_wait(&eng.barrier);
+    for (int i = 1; i < n; i++)
+        thread_join(threads[i]);
+}
+
+// ---------- Sampled simulation ----------
+
+static void functional_access(Simulator *sim, Core *c, uint32_t addr, bool store, bool warm) {
+    // Keeps the caches coherent with main memory, which the functional engine reads and writes directly.
+    // All lines stay clean while it runs (see flush_dirty_lines): a store invalidates the block elsewhere and
+    // leaves the writer's copy exclusive; with warm, misses also fill the requester's cache.
+    const MachineConfig *cfg = &sim->cfg;
+    uint32_t base = addr & ~(uint32_t)(cfg->block_words - 1);
+    bool others = false;
+    for (int i = 0; i < cfg->num_cores; i++) {
+        Cache *peer = &sim->cores[i].cache;
+        if (store && i != c->id && reservation_holds(peer, addr))
+            peer->reserved = false;
+        int slot = i == c->id ? -1 : cache_lookup(peer, addr);
+        if (slot < 0)
+            continue;
+        others = true;
+        peer->state[slot] = store ? MESI_I : MESI_S;
+    }
+    int slot = cache_lookup(&c->cache, addr);
+    if (slot < 0 && warm) {
+        uint32_t block[MAX_BLOCK_WORDS];
+        uint32_t evicted;
+        mem_read_block(&sim->mem, base, block, cfg->block_words);
+        slot = fill_cache_line(&c->cache, base, block, MESI_E, &sim->mem, &evicted);
+        snoop_filter_fill(&sim->filter, c->id, base, evicted, sim->cores, &sim->mem);
+    }
+    if (slot < 0)
+        return;
+    if (store) {
+        cache_write(&c->cache, slot, addr, mem_read(&sim->mem, addr));
+        c->cache.state[slot] = MESI_E;
+    } else if (others) {
+        c->cache.state[slot] = MESI_S;
+    }
+    if (warm)
+        cache_touch(&c->cache, slot);
+}
+
+typedef uint32_t (*FunctionalOp)(Simulator *sim, Core *c, const Instruction *inst, int32_t rs, int32_t rt, int32_t rd, bool warm);
+
+static uint32_t functional_alu(Simulator *sim, Core *c, const Instruction *inst, int32_t rs, int32_t rt, int32_t rd, bool warm) {
+    (void)sim; (void)c; (void)warm;
+    return perform_alu(inst, rs, rt, rd);
+}
+
+static uint32_t functional_branch(Simulator *sim, Core *c, const Instruction *inst, int32_t rs, int32_t rt, int32_t rd, bool warm) {
+    (void)sim; (void)warm;
+    if (perform_compare(inst, rs, rt)) {
+        c->redirect_pending = true;
+        c->redirect_pc = rd & 0x3FF;
+    }
+    return 0;
+}
+
+static uint32_t functional_jal(Simulator *sim, Core *c, const Instruction *inst, int32_t rs, int32_t rt, int32_t rd, bool warm) {
+    (void)sim; (void)warm;
+    c->redirect_pending = true;
+    c->redirect_pc = rd & 0x3FF;
+    return perform_alu(inst, rs, rt, rd);
+}
+
+static uint32_t functional_lw(Simulator *sim, Core *c, const Instruction *inst, int32_t rs, int32_t rt, int32_t rd, bool warm) {
+    (void)inst; (void)rd;
+    uint32_t addr = (uint32_t)(rs + rt) & ((1 << 20) - 1);
+    uint32_t value = mem_read(&sim->mem, addr);
+    functional_access(sim, c, addr, false, warm);
+    return value;
+}
+
+static uint32_t functional_sw(Simulator *sim, Core *c, const Instruction *inst, int32_t rs, int32_t rt, int32_t rd, bool warm) {
+    (void)inst;
+    uint32_t addr = (uint32_t)(rs + rt) & ((1 << 20) - 1);
+    mem_write(&sim->mem, addr, (uint32_t)rd);
+    functional_access(sim, c, addr, true, warm);
+    return 0;
+}
+
+static uint32_t functional_ll(Simulator *sim, Core *c, const Instruction *inst, int32_t rs, int32_t rt, int32_t rd, bool warm) {
+    uint32_t value = functional_lw(sim, c, inst, rs, rt, rd, warm);
+    c->cache.reserved = true;
+    c->cache.reserved_block = (uint32_t)(rs + rt) & ((1 << 20) - 1) & ~c->cache.geo.offset_mask;
+    return value;
+}
+
+static uint32_t functional_sc(Simulator *sim, Core *c, const Instruction *inst, int32_t rs, int32_t rt, int32_t rd, bool warm) {
+    uint32_t addr = (uint32_t)(rs + rt) & ((1 << 20) - 1);
+    bool holds = reservation_holds(&c->cache, addr);
+    c->cache.reserved = false;
+    if (!holds)
+        return 0;
+    functional_sw(sim, c, inst, rs, rt, rd, warm);
+    return 1;
+}
+
+static uint32_t functional_lwpi(Simulator *sim, Core *c, const Instruction *inst, int32_t rs, int32_t rt, int32_t rd, bool warm) {
+    (void)rd;
+    uint32_t addr = (uint32_t)rs & ((1 << 20) - 1);
+    uint32_t value = mem_read(&sim->mem, addr);
+    functional_access(sim, c, addr, false, warm);
+    if (inst->dst2 >= 0)
+        c->regs[inst->dst2] = (uint32_t)(rs + rt);
+    return value;
+}
+
+static uint32_t functional_vlw(Simulator *sim, Core *c, const Instruction *inst, int32_t rs, int32_t rt, int32_t rd, bool warm) {
+    (void)rd;
+    uint32_t addr = (uint32_t)(rs + rt) & ((1 << 20) - 1) & ~(uint32_t)(VEC_LANES - 1);
+    for (int k = 0; k < VEC_LANES; k++) {
+        uint32_t value = mem_read(&sim->mem, addr + (uint32_t)k);
+        functional_access(sim, c, addr + (uint32_t)k, false, warm);
+        if (inst->rd + k > 1 && inst->rd + k < 16)
+            c->regs[inst->rd + k] = value;
+    }
+    return 0;
+}
+
+static uint32_t functional_vsw(Simulator *sim, Core *c, const Instruction *inst, int32_t rs, int32_t rt, int32_t rd, bool warm) {
+    (void)rd;
+    uint32_t addr = (uint32_t)(rs + rt) & ((1 << 20) - 1) & ~(uint32_t)(VEC_LANES - 1);
+    for (int k = 0; k < VEC_LANES; k++) {
+        mem_write(&sim->mem, addr + (uint32_t)k, (uint32_t)lane_operand(c, inst, inst->rd + k, false));
+        functional_access(sim, c, addr + (uint32_t)k, true, warm);
+    }
+    return 0;
+}
+
+static uint32_t functional_halt(Simulator *sim, Core *c, const Instruction *inst, int32_t rs, int32_t rt, int32_t rd, bool warm) {
+    (void)sim; (void)inst; (void)rs; (void)rt; (void)rd; (void)warm;
+    c->halted = c->done = c->stop_fetch = true;
+    return 0;
+}
+
+static const FunctionalOp functional_ops[KIND_HANDLERS] = {
+    functional_alu, functional_branch, functional_jal, functional_lw, functional_sw, functional_ll, functional_sc,
+    functional_lwpi, functional_vlw, functional_vsw, functional_halt,
+};
+
+static void functional_step(Simulator *sim, Core *c, bool warm) {
+    // One instruction in program order, with the pipeline's architectural semantics: R1 holds the immediate,
+    // branches and jal take effect after the delay slot (redirect_pending), loads and stores go to main memory
+    const Instruction *inst = &c->prog[c->pc];
+    c->regs[1] = inst->imm;
+    int32_t rs = (int32_t)c->regs[inst->rs];
+    int32_t rt = (int32_t)c->regs[inst->rt];
+    int32_t rd = (int32_t)c->regs[inst->rd];
+    int next = c->redirect_pending ? c->redirect_pc : (c->pc + 1) & (IMEM_SIZE - 1);
+    c->redirect_pending = false;
+    uint32_t value = inst->kind == KIND_ALU ? perform_alu(inst, rs, rt, rd)
+                                            : functional_ops[inst->kind](sim, c, inst, rs, rt, rd, warm);
+    if (inst->dst >= 0)
+        c->regs[inst->dst] = value;
+    c->pc = next;
+    c->stats.functional_instructions++;
+}
+
+static uint8_t superblock_operand(const Instruction *inst, uint8_t reg, uint32_t *k) {
+    *k = reg == 1 ? (uint32_t)inst->imm : 0;
+    return reg > 1 ? reg : 0;
+}
+
+static void superblock_translate(const Instruction *prog, SuperOp *code) {
+    // Backwards, so each op's len extends the one after it; a superblock never wraps from PC 1023 to 0
+    for (int pc = IMEM_SIZE - 1; pc >= 0; pc--) {
+        const Instruction *inst = &prog[pc];
+        SuperOp *op = &code[pc];
+        memset(op, 0, sizeof(*op));
+        op->a = superblock_operand(inst, inst->rs, &op->ka);
+        op->b = superblock_operand(inst, inst->rt, &op->kb);
+        op->d = superblock_operand(inst, inst->rd, &op->kd);
+        bool control = is_control(inst);
+        bool nested = is_control(&prog[(pc + IMEM_SIZE - 1) & (IMEM_SIZE - 1)]) ||
+                      is_control(&prog[(pc + 1) & (IMEM_SIZE - 1)]);
+        const SuperOp *after = pc + 1 < IMEM_SIZE ? &code[pc + 1] : NULL;
+        if (inst->kind >= KIND_LW && inst->kind <= KIND_VSW) {
+            op->op = SB_MEM;
+        } else if (control && nested) {
+            op->op = SB_SLOW;
+        } else if (inst->kind == KIND_HALT) {
+            op->op = SB_HALT;
+        } else if (inst->kind == KIND_BRANCH) {
+            op->op = (uint8_t)(SB_BEQ + inst->op - OP_BEQ);
+        } else if (inst->kind == KIND_JAL) {
+            op->op = SB_JAL;
+            op->a = op->d;
+            op->ka = op->kd;
+            op->kb = (uint32_t)((pc + 1) & 0x3FF);
+        } else if (inst->dst < 0) {
+            op->op = SB_NOP;
+        } else if (inst->src_mask == 0 || inst->alu == ALU_NONE) {
+            op->op = SB_SET;
+            op->a = 0;
+            op->ka = perform_alu(inst, (int32_t)op->ka, (int32_t)op->kb, (int32_t)op->kd);
+        } else {
+            op->op = inst->op == OP_MAC ? SB_MAC : (uint8_t)(SB_ADD + inst->op - OP_ADD);
+        }
+        op->dst = (uint8_t)(inst->dst >= 0 ? inst->dst : 0);
+        if (op->op == SB_MEM || op->op == SB_SLOW)
+            op->len = 0;
+        else if (op->op == SB_HALT)
+            op->len = 1;
+        else if (control)
+            op->len = after && after->len ? 2 : 1; // with its delay slot, which is never a branch here
+        else
+            op->len = (uint16_t)(1 + (after ? after->len : 0));
+    }
+}
+
+static int superblock_run(Simulator *sim, Core *c, const SuperOp *code, int budget, bool warm) {
+    // Runs the core ahead by up to budget instructions, a superblock at a time. It stops in front of the next load
+    // or store, since only functional_phase knows whether its turn among the cores has come. Returns the count.
+    uint32_t *r = c->regs;
+    int done = 0;
+    while (done < budget && !c->done) {
+        const SuperOp *op = &code[c->pc];
+        if (op->op == SB_MEM)
+            break;
+        if (c->redirect_pending || op->op == SB_SLOW) {
+            // a delay slot entered after its branch, or a nested one
+            functional_step(sim, c, warm);
+            done++;
+            continue;
+        }
+        int n = op->len < budget - done ? op->len : budget - done;
+        int pc = c->pc;
+        int taken = -1; // index of a taken branch or jal in this run
+        uint32_t target = 0;
+        for (int k = 0; k < n; k++, op++) {
+            uint32_t x = r[op->a] + op->ka;
+            uint32_t y = r[op->b] + op->kb;
+            switch (op->op) {
+            case SB_NOP: break;
+            case SB_SET: r[op->dst] = op->ka; break;
+            case SB_ADD: r[op->dst] = x + y; break;
+            case SB_SUB: r[op->dst] = x - y; break;
+            case SB_AND: r[op->dst] = x & y; break;
+            case SB_OR: r[op->dst] = x | y; break;
+            case SB_XOR: r[op->dst] = x ^ y; break;
+            case SB_MUL: r[op->dst] = x * y; break;
+            case SB_SLL: r[op->dst] = x << (y & 0x1F); break;
+            case SB_SRA: r[op->dst] = (uint32_t)((int32_t)x >> (y & 0x1F)); break;
+            case SB_SRL: r[op->dst] = x >> (y & 0x1F); break;
+            case SB_MAC: r[op->dst] = r[op->d] + op->kd + x * y; break;
+            case SB_BEQ: if ((int32_t)x == (int32_t)y) taken = k; break;
+            case SB_BNE: if ((int32_t)x != (int32_t)y) taken = k; break;
+            case SB_BLT: if ((int32_t)x < (int32_t)y) taken = k; break;
+            case SB_BGT: if ((int32_t)x > (int32_t)y) taken = k; break;
+            case SB_BLE: if ((int32_t)x <= (int32_t)y) taken = k; break;
+            case SB_BGE: if ((int32_t)x >= (int32_t)y) taken = k; break;
+            case SB_JAL: taken = k; target = x; r[op->dst] = y; break;
+            case SB_HALT: c->halted = c->done = c->stop_fetch = true; break;
+            }
+            if (taken == k && op->op != SB_JAL)
+                target = r[op->d] + op->kd;
+        }
+        r[1] = (uint32_t)c->prog[pc + n - 1].imm; // as the interpreter leaves it
+        c->stats.functional_instructions += (uint32_t)n;
+        done += n;
+        c->pc = (pc + n) & (IMEM_SIZE - 1);
+        if (taken >= 0) {
+            if (taken < n - 1) {
+                c->pc = (int)(target & 0x3FF); // the delay slot ran too
+            } else {
+                c->redirect_pending = true;
+                c->redirect_pc = (int)(target & 0x3FF);
+            }
+        }
+    }
+    return done;
+}
+
+static void functional_phase(Simulator *sim, int count, bool warm) {
+    // count instructions on every core that has not halted, with the result of running them round robin one
+    // instruction at a time. Only loads and stores see other cores, so each core runs ahead to its next one, and
+    // they execute in (instruction index, core) order, the rank interpreting them round robin gives them.
+    int n = sim->cfg.num_cores;
+    if (!sim->superblocks) {
+        bool running = true;
+        for (int k = 0; k < count && running; k++) {
+            running = false;
+            for (int i = 0; i < n; i++) {
+                if (!sim->cores[i].done) {
+                    functional_step(sim, &sim->cores[i], warm);
+                    running = true;
+                }
+            }
+        }
+        return;
+    }
+    int at[MAX_CORES];
+    for (int i = 0; i < n; i++)
+        at[i] = superblock_run(sim, &sim->cores[i], sim->superblocks + (size_t)i * IMEM_SIZE, count, warm);
+    for (;;) {
+        int next = -1;
+        for (int i = 0; i < n; i++) {
+            if (!sim->cores[i].done && at[i] < count && (next < 0 || at[i] < at[next]))
+                next = i;
+        }
+        if (next < 0)
+            break;
+        Core *c = &sim->cores[next];
+        functional_step(sim, c, warm);
+        at[next]++;
+        at[next] += superblock_run(sim, c, sim->superblocks + (size_t)next * IMEM_SIZE, count - at[next], warm);
+    }
 }
 
-static void start_bus_transaction(BusState *bus, const BusRequest *req, Core cores[NUM_CORES], uint32_t *mem) {
-    // Capture snapshot of request and decide data source (memory or peer cache)
-    bus->cmd = req->cmd;
-    bus->origin = req->origin;
-    bus->addr = req->addr;
-    bus->shared = 0;
-    bus->provider = -1;
-    bus->index = 0;
-    uint32_t provider_block[BLOCK_WORDS] = {0};
+static void leave_detailed(Simulator *sim) {
+    // After a drain every delay slot has executed, so a redirect still pending names the next instruction
+    for (int i = 0; i < sim->cfg.num_cores; i++) {
+        Core *c = &sim->cores[i];
+        if (c->redirect_pending) {
+            c->pc = c->redirect_pc;
+            c->redirect_pending = false;
+        }
+    }
+}
 
-    // snoop caches
-    for (int i = 0; i < NUM_CORES; i++) {
-        apply_snoop(&cores[i].cache, i, req->origin, req->cmd, req->addr, &bus->shared, &bus->provider, provider_block);
+static bool all_done(const Simulator *sim) {
+    for (int i = 0; i < sim->cfg.num_cores; i++) {
+        if (!sim->cores[i].done)
+            return false;
     }
+    return true;
+}
 
-    if (bus->provider == -1) {
-        // served by memory
-        bus->provider = 4;
-        uint32_t base = req->addr & ~(BLOCK_WORDS - 1);
-        for (int i = 0; i < BLOCK_WORDS; i++)
-            bus->block[i] = mem[(base + i) & (MAIN_MEM_WORDS - 1)];
-        bus->delay = 16;
-        bus->phase = 1; // wait
-    } else {
-        // served by cache
-        for (int i = 0; i < BLOCK_WORDS; i++)
-            bus->block[i] = provider_block[i];
-        bus->delay = 0;
-        bus->phase = 1; // ready to flush next cycle
-        bus->index = 0;
+static void enter_detailed(Simulator *sim) {
+    // Restart each pipeline at the functional PC the way sim_load starts it at 0; a pending redirect is
+    // taken by the next fetch, after the delay slot now in the fetch latch. Reservations are dropped, since a
+    // cold functional ll may hold one on a line its cache never filled (the next sc fails and is retried).
+    for (int i = 0; i < sim->cfg.num_cores; i++) {
+        Core *c = &sim->cores[i];
+        c->drain = false;
+        c->cache.reserved = false;
+        if (c->done)
+            continue;
+        PIPE(c)->fetch.valid = true;
+        PIPE(c)->fetch.inst = c->prog[c->pc];
+        if (PIPE(c)->fetch.inst.op == OP_HALT)
+            c->stop_fetch = true;
+        c->pc = (c->pc + 1) & (IMEM_SIZE - 1);
     }
-    reset_bus_out(bus);
-    bus->bus_cmd_out = req->cmd;
-    bus->bus_origid_out = req->origin;
-    bus->bus_addr_out = req->addr & ((1 << 20) - 1);
-    bus->bus_shared_out = bus->shared;
 }
 
-// ---------- Tracing ----------
+static bool pipelines_drained(Simulator *sim) {
+    // Every core empty and the bus idle; a prefetch still waiting for a grant is dropped
+    for (int i = 0; i < sim->cfg.num_cores; i++) {
+        const Core *c = &sim->cores[i];
+        bool busy = PIPE(c)->fetch.valid || PIPE(c)->decode.valid || PIPE(c)->exec.valid || PIPE(c)->mem.valid || PIPE(c)->wb.valid;
+        if (!c->done && (busy || c->sb.count || c->fill_pending || sim->requests[i].active))
+            return false;
+    }
+    if (sim->bus.phase != 0 || sim->bus.queued != 0)
+        return false;
+    for (int i = 0; i < sim->cfg.num_cores; i++) {
+        sim->prefetches[i].active = false;
+        sim->cores[i].pf.inflight = false;
+        sim->cores[i].pf.count = 0;
+    }
+    return true;
+}
+
+static void flush_dirty_lines(Simulator *sim) {
+    // Functional phases read main memory directly, so modified lines are written back and kept as E
+    for (int i = 0; i < sim->cfg.num_cores; i++) {
+        Cache *cache = &sim->cores[i].cache;
+        for (int slot = 0; slot < cache->geo.lines; slot++) {
+            if (cache->state[slot] == MESI_M) {
+                writeback_line(cache, slot, &sim->mem);
+                cache->state[slot] = MESI_E;
+            }
+        }
+    }
+}
+
+static bool run_detailed(Simulator *sim, int cycles, bool measure) {
+    // Up to `cycles` pipeline cycles; returns true when the run is over
+    int n = sim->cfg.num_cores;
+    uint32_t cycles0[MAX_CORES], instructions0[MAX_CORES];
+    for (int i = 0; i < n; i++) {
+        cycles0[i] = sim->cores[i].stats.cycles;
+        instructions0[i] = sim->cores[i].stats.instructions;
+    }
+    bool stop = false;
+    for (int k = 0; k < cycles && !stop; k++) {
+        sim_cycle(sim);
+        stop = sim_stop_after_cycle(sim);
+        if (!stop)
+            sim->cycle++;
+    }
+    if (measure) {
+        for (int i = 0; i < n; i++) {
+            Stats *st = &sim->cores[i].stats;
+            st->sample_cycles += st->cycles - cycles0[i];
+            st->sample_instructions += st->instructions - instructions0[i];
+        }
+    }
+    return stop;
+}
 
-static void write_core_trace(int cycle, const Core *c) {
-    if (!c->trace_fp)
+static void sim_run_sampled(Simulator *sim) {
+    // SMARTS-style systematic sampling: functional phase, detailed warm-up, measured window, drain; repeat.
+    // Traces and the regular stats only cover the detailed cycles; est_cycles extrapolates the measured CPI.
+    const SimOptions *opt = &sim->opt;
+    int n = sim->cfg.num_cores;
+    for (int i = 0; i < n; i++) {
+        // sim_load primed the fetch latch; the first phase is functional, starting at PC 0
+        Core *c = &sim->cores[i];
+        PIPE(c)->fetch.valid = false;
+        c->stop_fetch = false;
+        c->pc = 0;
+        if (sim->superblocks)
+            superblock_translate(c->prog, sim->superblocks + (size_t)i * IMEM_SIZE);
+    }
+    while (!all_done(sim)) {
+        functional_phase(sim, opt->sample_functional, !opt->sample_cold);
+        if (all_done(sim))
+            break;
+        enter_detailed(sim);
+        if (run_detailed(sim, opt->sample_warmup, false) || run_detailed(sim, opt->sample_measure, true))
+            break;
+        for (int i = 0; i < n; i++)
+            sim->cores[i].drain = true;
+        bool over = false;
+        while (!over && !pipelines_drained(sim))
+            over = run_detailed(sim, 1, false);
+        if (over)
+            break;
+        leave_detailed(sim);
+        flush_dirty_lines(sim);
+    }
+    // A core without measured instructions gets no est_cycles (see write_stats)
+    bool measured = false;
+    for (int i = 0; i < n; i++)
+        measured |= sim->cores[i].stats.sample_cycles != 0;
+    if (!measured) {
+        fprintf(stderr, "warning: SIM_SAMPLE: the run ended before any measured window, so no stats file has est_cycles\n");
         return;
-    // Only dump a line when something is in flight in the pipeline
-    bool active = c->fetch.valid || c->decode.valid || c->exec.valid || c->mem.valid || c->wb.valid;
-    if (!active)
+    }
+    for (int i = 0; i < n; i++) {
+        const Stats *st = &sim->cores[i].stats;
+        if (st->sample_cycles == 0)
+            fprintf(stderr, "warning: SIM_SAMPLE: core %d halted before any measured window, so stats%d.txt has no "
+                            "est_cycles\n", i, i);
+        else if (st->sample_instructions == 0)
+            fprintf(stderr, "warning: SIM_SAMPLE: core %d retired nothing in %u measured cycles, so stats%d.txt has no "
+                            "est_cycles\n", i, st->sample_cycles, i);
+    }
+}
+
+// ---------- Profile listings ----------
+
+static void shared_output_path(const Simulator *sim, const char **files, const char *name, char *path) {
+    // Machine-wide outputs go next to stats0.txt
+    const char *stats_path = files[run_file_index(RUN_STATS, sim->cfg.num_cores, 0)];
+    size_t dir = strlen(stats_path);
+    while (dir > 0 && stats_path[dir - 1] != '/' && stats_path[dir - 1] != '\\')
+        dir--;
+    snprintf(path, RUN_PATH_MAX, "%.*s%s", (int)dir, stats_path, name);
+}
+
+typedef struct {
+    // The .asm text a core's program came from, when it can be found and still assembles to the loaded words
+    asm_program *prog;
+    char *text;
+    size_t *line_start; // offset of every source line (0-based index)
+    int lines;
+    const char *label[IMEM_SIZE]; // first label defined at each PC
+} ProfileSource;
+
+static bool profile_source_path(const char *imem_path, char *out, size_t size) {
+    // The input itself for .asm programs, otherwise a sibling .asm with the same base name (imem0.txt -> imem0.asm)
+    size_t n = strlen(imem_path);
+    if (n + 1 > size)
+        return false;
+    memcpy(out, imem_path, n + 1);
+    if (!is_asm_source(out)) {
+        if (n < 4 || out[n - 4] != '.')
+            return false;
+        memcpy(out + n - 3, "asm", 4);
+    }
+    FILE *fp = fopen(out, "rb");
+    if (!fp)
+        return false;
+    fclose(fp);
+    return true;
+}
+
+static bool open_profile_source(ProfileSource *src, const char *imem_path, const uint32_t *imem) {
+    memset(src, 0, sizeof(*src));
+    char path[ASM_CACHE_PATH_MAX];
+    if (!profile_source_path(imem_path, path, sizeof(path)))
+        return false;
+    MappedFile m;
+    map_file(path, &m);
+    src->text = (char *)malloc(m.size + 1);
+    src->prog = asm_alloc();
+    if (!src->text || !src->prog) {
+        fprintf(stderr, "Failed to allocate profile source\n");
+        exit(1);
+    }
+    if (m.size)
+        memcpy(src->text, m.data, m.size);
+    src->text[m.size] = 0;
+    size_t size = m.size;
+    unmap_file(&m);
+    bool ok = asm_text(src->prog, src->text, size) == 0;
+    for (int i = 0; ok && i < IMEM_SIZE; i++)
+        ok = (uint32_t)src->prog->imem[i] == imem[i];
+    if (!ok) {
+        // stale source: fall back to disassembly
+        free(src->text);
+        asm_free(src->prog);
+        memset(src, 0, sizeof(*src));
+        return false;
+    }
+    int cap = 1024;
+    src->line_start = (size_t *)malloc((size_t)cap * sizeof(size_t));
+    for (size_t pos = 0; src->line_start && pos < size; src->lines++) {
+        if (src->lines == cap) {
+            cap *= 2;
+            src->line_start = (size_t *)realloc(src->line_start, (size_t)cap * sizeof(size_t));
+            if (!src->line_start)
+                break;
+        }
+        src->line_start[src->lines] = pos;
+        while (pos < size && src->text[pos] != '\n')
+            pos++;
+        pos++;
+    }
+    if (!src->line_start) {
+        fprintf(stderr, "Failed to allocate profile source\n");
+        exit(1);
+    }
+    // the text itself becomes one NUL-terminated string per line
+    for (size_t pos = 0; pos < size; pos++) {
+        if (src->text[pos] == '\n' || src->text[pos] == '\r')
+            src->text[pos] = 0;
+    }
+    for (int i = 0; i < src->prog->symtab_count; i++) {
+        const asm_symbol *sym = &src->prog->symtab[src->prog->symtab_slots[i]];
+        if (sym->pc >= 0 && sym->pc < IMEM_SIZE && !src->label[sym->pc])
+            src->label[sym->pc] = sym->name;
+    }
+    return true;
+}
+
+static void close_profile_source(ProfileSource *src) {
+    free(src->text);
+    free(src->line_start);
+    asm_free(src->prog);
+}
+
+static void instruction_text(const ProfileSource *src, int pc, uint32_t word, bool code_only, char *out, size_t size) {
+    // Source line of the instruction (without its comment when code_only), or its disassembly
+    if (src->prog && pc < src->prog->pc) {
+        int line = src->prog->src_line[pc];
+        const char *text = (line >= 1 && line <= src->lines) ? src->text + src->line_start[line - 1] : "";
+        while (*text == ' ' || *text == '\t')
+            text++;
+        size_t n = code_only ? strcspn(text, "#") : strlen(text);
+        while (n > 0 && (text[n - 1] == ' ' || text[n - 1] == '\t'))
+            n--;
+        snprintf(out, size, "%.*s", (int)n, text);
+    } else {
+        Instruction inst = decode_inst(word, pc);
+        const char *op = inst.op < ASM_OPCODES ? asm_op_name[inst.op] : "?";
+        snprintf(out, size, "%s %s, %s, %s, %d", op, asm_reg_altname[inst.rd], asm_reg_altname[inst.rs],
+                 asm_reg_altname[inst.rt], inst.imm);
+    }
+}
+
+static void write_folded(FILE *fp, int core, const char *region, const char *code, const char *event, uint32_t count) {
+    // flamegraph.pl input: frames separated by ';', then the count
+    if (count == 0)
         return;
+    fprintf(fp, "core%d;%s;", core, region);
+    for (const char *p = code; *p; p++)
+        fputc(*p == ';' ? ',' : *p, fp);
+    fprintf(fp, ";%s %u\n", event, count);
+}
+
+static void write_profile(Simulator *sim, const char **files) {
+    // <prefix>profileN.txt: annotated listing of core N; <prefix>profile.folded: every core, flame-graph format.
+    // Both go next to stats0.txt like busstats.json, so every run of a batch keeps its own profile.
+    const char *prefix = sim->opt.profile_prefix;
+    static const char *const stall_names[STALL_KINDS] = {"decode_exec", "decode_mem", "decode_wb", "decode_busy"};
+    int n = sim->cfg.num_cores;
+    char name[RUN_PATH_MAX];
+    char path[RUN_PATH_MAX];
+    snprintf(name, sizeof(name), "%sprofile.folded", prefix);
+    shared_output_path(sim, files, name, path);
+    FILE *folded = fopen(path, "wt");
+    for (int i = 0; i < n; i++) {
+        const Core *c = &sim->cores[i];
+        const ProfileRow *rows = profile_row(sim->profile, c, 0);
+        snprintf(name, sizeof(name), "%sprofile%d.txt", prefix, i);
+        shared_output_path(sim, files, name, path);
+        FILE *fp = fopen(path, "wt");
+        if (!fp) {
+            fprintf(stderr, "Failed to open %s for write\n", path);
+            continue;
+        }
+        const char *imem_path = files[run_file_index(RUN_IMEM, n, i)];
+        ProfileSource src;
+        bool have_source = open_profile_source(&src, imem_path, c->imem);
+        static const ProfileRow empty;
+        int last = IMEM_SIZE - 1;
+        while (last >= 0 && c->imem[last] == 0 && memcmp(&rows[last], &empty, sizeof(empty)) == 0)
+            last--;
+        fprintf(fp, "# core %d: %s (%s)\n", i, imem_path, have_source ? "source lines" : "disassembly");
+        fprintf(fp, "#  pc  retired dec_exec  dec_mem   dec_wb dec_busy load_use mem_stall rd_miss wr_miss  source\n");
+        ProfileRow total;
+        memset(&total, 0, sizeof(total));
+        const char *region = "start";
+        for (int pc = 0; pc <= last; pc++) {
+            const ProfileRow *r = &rows[pc];
+            char text[256], code[256];
+            instruction_text(&src, pc, c->imem[pc], false, text, sizeof(text));
+            instruction_text(&src, pc, c->imem[pc], true, code, sizeof(code));
+            if (src.label[pc]) {
+                region = src.label[pc];
+                fprintf(fp, "%s:\n", region);
+            }
+            fprintf(fp, "  %03X %8u %8u %8u %8u %8u %8u %9u %7u %7u  ", pc, r->retired, r->decode_stall[STALL_EXEC],
+                    r->decode_stall[STALL_MEM], r->decode_stall[STALL_WB], r->decode_stall[STALL_BUSY],
+                    r->load_use_stall, r->mem_stall, r->read_miss, r->write_miss);
+            if (have_source && pc < src.prog->pc)
+                fprintf(fp, "%d: ", src.prog->src_line[pc]);
+            fprintf(fp, "%s\n", text);
+            total.retired += r->retired;
+            for (int k = 0; k < STALL_KINDS; k++)
+                total.decode_stall[k] += r->decode_stall[k];
+            total.load_use_stall += r->load_use_stall;
+            total.mem_stall += r->mem_stall;
+            total.read_miss += r->read_miss;
+            total.write_miss += r->write_miss;
+            if (folded) {
+                char frame[300];
+                snprintf(frame, sizeof(frame), "%03X %s", pc, code);
+                write_folded(folded, i, region, frame, "retired", r->retired);
+                for (int k = 0; k < STALL_KINDS; k++)
+                    write_folded(folded, i, region, frame, stall_names[k], r->decode_stall[k]);
+                write_folded(folded, i, region, frame, "load_use", r->load_use_stall);
+                write_folded(folded, i, region, frame, "mem_stall", r->mem_stall);
+                write_folded(folded, i, region, frame, "read_miss", r->read_miss);
+                write_folded(folded, i, region, frame, "write_miss", r->write_miss);
+            }
+        }
+        fprintf(fp, "total %8u %8u %8u %8u %8u %8u %9u %7u %7u\n", total.retired, total.decode_stall[STALL_EXEC],
+                total.decode_stall[STALL_MEM], total.decode_stall[STALL_WB], total.decode_stall[STALL_BUSY],
+                total.load_use_stall, total.mem_stall, total.read_miss, total.write_miss);
+        if (have_source)
+            close_profile_source(&src);
+        fclose(fp);
+    }
+    if (folded)
+        fclose(folded);
+}
 
-    char fbuf[4] = "---", dbuf[4] = "---", ebuf[4] = "---", mbuf[4] = "---", wbuf[4] = "---";
-    if (c->fetch.valid)
-        snprintf(fbuf, sizeof(fbuf), "%03X", c->fetch.inst.pc & 0x3FF);
-    if (c->decode.valid)
-        snprintf(dbuf, sizeof(dbuf), "%03X", c->decode.inst.pc & 0x3FF);
-    if (c->exec.valid)
-        snprintf(ebuf, sizeof(ebuf), "%03X", c->exec.inst.pc & 0x3FF);
-    if (c->mem.valid)
-        snprintf(mbuf, sizeof(mbuf), "%03X", c->mem.inst.pc & 0x3FF);
-    if (c->wb.valid)
-        snprintf(wbuf, sizeof(wbuf), "%03X", c->wb.inst.pc & 0x3FF);
+// ---------- Bus statistics file ----------
 
-    fprintf(c->trace_fp,
-            "%d %s %s %s %s %s %08X %08X %08X %08X %08X %08X %08X %08X %08X %08X %08X %08X %08X %08X\n",
-            cycle, fbuf, dbuf, ebuf, mbuf, wbuf,
-            c->regs[2], c->regs[3], c->regs[4], c->regs[5], c->regs[6], c->regs[7],
-            c->regs[8], c->regs[9], c->regs[10], c->regs[11], c->regs[12], c->regs[13],
-            c->regs[14], c->regs[15]);
+static void write_histogram(FILE *fp, const char *name, const Histogram *h) {
+    // Only the non-empty power-of-two buckets, each with its inclusive value range
+    fprintf(fp, "\"%s\": {\"count\": %u, \"mean\": %.2f, \"max\": %u, \"buckets\": [", name, h->count,
+            h->count ? (double)h->total / h->count : 0.0, h->max);
+    const char *sep = "";
+    for (int k = 0; k < HIST_BUCKETS; k++) {
+        if (!h->bucket[k])
+            continue;
+        uint32_t lo = k ? 1u << (k - 1) : 0;
+        uint32_t hi = k ? (1u << (k - 1)) * 2 - 1 : 0;
+        fprintf(fp, "%s{\"min\": %u, \"max\": %u, \"count\": %u}", sep, lo, hi, h->bucket[k]);
+        sep = ", ";
+    }
+    fprintf(fp, "]}");
 }
 
-static void write_bus_trace(FILE *fp, int cycle, const BusState *bus) {
-    if (!fp || bus->bus_cmd_out == BUS_NONE)
+static void write_bus_stats(Simulator *sim, const char **files) {
+    // busstats.json in the directory of stats0.txt (bus-wide totals, utilization windows, then one entry per core)
+    const BusStats *bs = sim->bus_stats;
+    int n = sim->cfg.num_cores;
+    char path[RUN_PATH_MAX];
+    shared_output_path(sim, files, "busstats.json", path);
+    FILE *fp = fopen(path, "wt");
+    if (!fp) {
+        fprintf(stderr, "Failed to open %s for write\n", path);
         return;
-    fprintf(fp, "%d %X %X %05X %08X %X\n", cycle, bus->bus_origid_out, bus->bus_cmd_out,
-            bus->bus_addr_out & ((1 << 20) - 1), bus->bus_data_out, bus->bus_shared_out);
+    }
+    uint32_t cycles = 0, from_cache = 0, from_memory = 0, busy = 0;
+    for (int i = 0; i < n; i++) {
+        if (sim->cores[i].stats.cycles > cycles)
+            cycles = sim->cores[i].stats.cycles;
+        from_cache += bs->core[i].from_cache;
+        from_memory += bs->core[i].from_memory;
+    }
+    int windows = (int)((cycles + (uint32_t)bs->window - 1) / (uint32_t)bs->window);
+    if (windows < bs->windows)
+        windows = bs->windows;
+    for (int w = 0; w < bs->windows; w++)
+        busy += bs->busy[w];
+    fprintf(fp, "{\n  \"cycles\": %u,\n  \"transactions\": %u,\n  \"from_cache\": %u,\n  \"from_memory\": %u,\n", cycles,
+            from_cache + from_memory, from_cache, from_memory);
+    fprintf(fp, "  \"busy_cycles\": %u,\n  \"window\": %d,\n  \"window_busy\": [", busy, bs->window);
+    for (int w = 0; w < windows; w++)
+        fprintf(fp, "%s%u", w ? ", " : "", w < bs->windows ? bs->busy[w] : 0);
+    fprintf(fp, "],\n  \"cores\": [\n");
+    for (int i = 0; i < n; i++) {
+        const BusCoreStats *s = &bs->core[i];
+        fprintf(fp, "    {\"core\": %d, \"from_cache\": %u, \"from_memory\": %u, \"provided\": %u, \"invalidated\": %u, "
+                    "\"invalidations\": %u,\n     ",
+                i, s->from_cache, s->from_memory, s->provided, s->invalidated, s->invalidations);
+        write_histogram(fp, "wait", &s->wait);
+        fprintf(fp, ",\n     ");
+        write_histogram(fp, "miss_latency", &s->miss_latency);
+        fprintf(fp, "}%s\n", i + 1 < n ? "," : "");
+    }
+    fprintf(fp, "  ]\n}\n");
+    fclose(fp);
 }
 
-// ---------- Main simulation logic ----------
+static void write_l2(Simulator *sim, const char **files) {
+    // l2dsram.txt, l2tsram.txt and l2stats.txt next to stats0.txt. Called after the private caches are
+    // written back, so the data of each valid line is memory's copy of its block (zeros for invalid lines).
+    const Cache *tags = &sim->l2.tags;
+    const L2Stats *st = &sim->l2.stats;
+    int lines = tags->geo.lines, words = tags->geo.block_words;
+    uint32_t *dump = (uint32_t *)calloc((size_t)lines * (size_t)words, sizeof(uint32_t));
+    if (!dump) {
+        fprintf(stderr, "Failed to allocate L2 dump\n");
+        exit(1);
+    }
+    char path[RUN_PATH_MAX];
+    for (int j = 0; j < lines; j++) {
+        if (tags->state[j] != MESI_I)
+            mem_read_block(&sim->mem, line_base_addr(tags, j), dump + (size_t)j * (size_t)words, words);
+    }
+    shared_output_path(sim, files, "l2dsram.txt", path);
+    write_full_mem(path, dump, lines * words);
+    // same layout as tsram: state (0 invalid, 1 valid) above a tag field of at least 12 bits
+    int state_shift = ADDR_BITS - tags->geo.tag_shift;
+    if (state_shift < 12)
+        state_shift = 12;
+    for (int j = 0; j < lines; j++)
+        dump[j] = ((uint32_t)tags->state[j] << state_shift) | tags->tag[j];
+    shared_output_path(sim, files, "l2tsram.txt", path);
+    write_full_mem(path, dump, lines);
+    free(dump);
 
-static int perform_compare(const Instruction *inst, int32_t rs, int32_t rt) {
-    switch (inst->op) {
-    case OP_BEQ: return rs == rt;
-    case OP_BNE: return rs != rt;
-    case OP_BLT: return rs < rt;
-    case OP_BGT: return rs > rt;
-    case OP_BLE: return rs <= rt;
-    case OP_BGE: return rs >= rt;
-    default: return 0;
+    shared_output_path(sim, files, "l2stats.txt", path);
+    FILE *fp = fopen(path, "wt");
+    if (!fp) {
+        fprintf(stderr, "Failed to open %s for write\n", path);
+        return;
     }
+    fprintf(fp, "hits %u\n", st->hits);
+    fprintf(fp, "peer_fills %u\n", st->peer_fills);
+    fprintf(fp, "misses %u\n", st->misses);
+    fprintf(fp, "evictions %u\n", st->evictions);
+    fprintf(fp, "back_invalidations %u\n", st->back_invalidations);
+    fprintf(fp, "back_writebacks %u\n", st->back_writebacks);
+    fclose(fp);
 }
 
-static uint32_t perform_alu(const Instruction *inst, int32_t rs, int32_t rt) {
-    uint32_t shift = ((uint32_t)rt) & 0x1F;
-    switch (inst->op) {
-    case OP_ADD: return (uint32_t)(rs + rt);
-    case OP_SUB: return (uint32_t)(rs - rt);
-    case OP_AND: return (uint32_t)(rs & rt);
-    case OP_OR:  return (uint32_t)(rs | rt);
-    case OP_XOR: return (uint32_t)(rs ^ rt);
-    case OP_MUL: return (uint32_t)(rs * rt);
-    case OP_SLL: return (uint32_t)((uint32_t)rs << shift);
-    case OP_SRA: return (uint32_t)((int32_t)rs >> shift);
-    case OP_SRL: return (uint32_t)((uint32_t)rs >> shift);
-    case OP_JAL: return (uint32_t)((inst->pc + 1) & 0x3FF);
-    default: return 0;
-    }
-}
-
-static void simulate(const char **files, uint32_t *main_mem) {
-    Core cores[NUM_CORES] = {0};
-    BusRequest requests[NUM_CORES] = {0};
-    BusState bus = {0};
-    int rr_next = 0;
-    const char *limit_env = getenv("SIM_MAX_CYCLES");
-    int max_cycles = -1;
-    if (limit_env)
-        max_cycles = atoi(limit_env);
-    bool debug_branch = getenv("SIM_DEBUG_BRANCH") != NULL; // optional stderr logging for branch decisions
-
-    // file order: 0-3 imem, 4 memin, 5 memout, 6-9 regout, 10-13 coretrace, 14 bustrace,
-    // 15-18 dsram, 19-22 tsram, 23-26 stats
-    for (int i = 0; i < NUM_CORES; i++) {
-        cores[i].id = i;
-        load_imem(files[i], cores[i].imem);
-        cores[i].pc = 0;
-        cores[i].regs[0] = 0;
-        cores[i].regs[1] = 0;
-        cores[i].trace_fp = fopen(files[10 + i], "wt");
-        Instruction first = decode_inst(cores[i].imem[cores[i].pc], cores[i].pc);
-        cores[i].fetch.valid = true;
-        cores[i].fetch.inst = first;
-        if (first.op == OP_HALT)
-            cores[i].stop_fetch = true;
-        cores[i].pc = (cores[i].pc + 1) & (IMEM_SIZE - 1);
-        cores[i].decode.valid = false;
-        cores[i].exec.valid = false;
-        cores[i].mem.valid = false;
-        cores[i].wb.valid = false;
+typedef struct {
+    // sim_finish outputs; the caller and its dump helpers claim them in order through `next`
+    Simulator *sim;
+    const char **files;
+    uint32_t count;
+    volatile uint32_t next;
+} OutputQueue;
+
+#define OUTPUTS_PER_CORE 4
+
+static void write_tsram(const char *path, const Cache *cache) {
+    // One row per line slot (set * ways + way): MESI above a tag field of at least 12 bits
+    // (13:12 and 11:0 for the default geometry)
+    uint32_t *tsram = (uint32_t *)malloc((size_t)cache->geo.lines * sizeof(uint32_t));
+    if (!tsram) {
+        fprintf(stderr, "Failed to allocate tsram dump\n");
+        exit(1);
     }
-    load_mem(files[4], main_mem);
-    FILE *bus_fp = fopen(files[14], "wt");
+    int state_shift = ADDR_BITS - cache->geo.tag_shift;
+    if (state_shift < 12)
+        state_shift = 12;
+    for (int j = 0; j < cache->geo.lines; j++) {
+        tsram[j] = ((uint32_t)cache->state[j] << state_shift) | cache->tag[j];
+    }
+    write_full_mem(path, tsram, cache->geo.lines);
+    free(tsram);
+}
 
-    // Each core owns a slot in requests[]; when a miss/upgrade happens MEM sets active=true and waits for arbitration.
-    int cycle = 0;
-    // Cycle order:
-    // 1) Capture traces for current latch contents
-    // 2) Commit WB writes
-    // 3) Compute next-state for all pipeline stages (no forwarding)
-    // 4) Arbitrate bus requests and drive bus outputs
-    // 5) Advance bus timing (flush/latency)
-    // 6) Check for completion/timeout
-    while (1) {
-        reset_bus_out(&bus);
-
-        // trace before state changes (Q state of pipeline latches)
-        for (int i = 0; i < NUM_CORES; i++)
-            write_core_trace(cycle, &cores[i]);
-
-        // WB stage: commit register writes and mark HALT retirement
-        for (int i = 0; i < NUM_CORES; i++) {
-            Core *c = &cores[i];
-            if (c->wb.valid) {
-                int dst = dest_reg(&c->wb.inst);
-                if (dst >= 0)
-                    c->regs[dst] = c->wb.value;
-                c->stats.instructions++;
-                if (c->wb.inst.op == OP_HALT)
-                    c->halted = true;
-            }
-        }
+static void write_output(Simulator *sim, const char **files, uint32_t job) {
+    int n = sim->cfg.num_cores;
+    if (job == 0) {
+        write_trimmed_mem(files[run_file_index(RUN_MEMOUT, n, 0)], &sim->mem);
+        return;
+    }
+    int i = (int)((job - 1) / OUTPUTS_PER_CORE);
+    const Core *c = &sim->cores[i];
+    switch ((job - 1) % OUTPUTS_PER_CORE) {
+    case 0:
+        write_regout(files[run_file_index(RUN_REGOUT, n, i)], c->regs);
+        break;
+    case 1:
+        write_full_mem(files[run_file_index(RUN_DSRAM, n, i)], c->cache.data, c->cache.geo.lines * c->cache.geo.block_words);
+        break;
+    case 2:
+        write_tsram(files[run_file_index(RUN_TSRAM, n, i)], &c->cache);
+        break;
+    default:
+        write_stats(files[run_file_index(RUN_STATS, n, i)], &c->stats, &sim->cfg, sim->opt.sampled);
+        break;
+    }
+}
 
-        // pipeline advance (simulate combinational logic for next cycle)
-        for (int i = 0; i < NUM_CORES; i++) {
-            Core *c = &cores[i];
-            if (!c->done)
-                c->stats.cycles++;
+static void output_worker(void *arg) {
+    OutputQueue *q = (OutputQueue *)arg;
+    while (1) {
+        uint32_t job = atomic_fetch_add_u32(&q->next, 1);
+        if (job >= q->count)
+            break;
+        write_output(q->sim, q->files, job);
+    }
+}
 
-            WbStage next_wb = {0};
-            MemStage next_mem = c->mem;
-            ExecStage next_exec = c->exec;
-            DecodeStage next_decode = c->decode;
-            FetchStage next_fetch = c->fetch;
+static void sim_finish(Simulator *sim, const char **files) {
+    Core *cores = sim->cores;
+    MainMemory *main_mem = &sim->mem;
 
-            bool mem_advances = false;
+    // Close trace files
+    if (sim->opt.async_trace)
+        trace_writer_stop(&sim->writer);
+    int n = sim->cfg.num_cores;
+    for (int i = 0; i < n; i++) {
+        trace_dump_recorder(&cores[i].trace, sim->cycle);
+        trace_close(&cores[i].trace);
+    }
+    trace_dump_recorder(&sim->bus_trace, sim->cycle);
+    trace_close(&sim->bus_trace);
 
-            // MEM stage: handle cache access, misses enqueue bus requests
-            if (c->mem.valid) {
-                if (c->mem.waiting) {
-                    // Waiting for bus transaction to complete
-                    c->stats.mem_stall++;
-                    mem_advances = false;
-                } else {
-                    Instruction *inst = &c->mem.inst;
-                    if (inst->op == OP_LW || inst->op == OP_SW) {
-                        bool counted = c->mem.miss;
-                        int state = MESI_I;
-                        bool hit = cache_lookup(&c->cache, c->mem.mem_addr, &state);
-                        if (!counted) {
-                            if (hit && state != MESI_I) {
-                                if (inst->op == OP_LW)
-                                    c->stats.read_hit++;
-                                else
-                                    c->stats.write_hit++;
-                            } else {
-                                if (inst->op == OP_LW)
-                                    c->stats.read_miss++;
-                                else
-                                    c->stats.write_miss++;
-                            }
-                        }
+    // Write back all dirty cache lines to main memory before dumping outputs
+    for (int c = 0; c < n; c++) {
+        for (int idx = 0; idx < cores[c].cache.geo.lines; idx++) {
+            writeback_line(&cores[c].cache, idx, main_mem);
+        }
+    }
 
-                        if (!hit || state == MESI_I || (inst->op == OP_SW && state == MESI_S)) {
-                            if (!c->mem.request_queued) {
-                                requests[i].active = true;
-                                requests[i].cmd = (inst->op == OP_LW) ? BUS_RD : BUS_RDX;
-                                requests[i].addr = c->mem.mem_addr & ((1 << 20) - 1);
-                                requests[i].origin = i;
-                                c->mem.request_queued = true;
-                            }
-                            next_mem.miss = true;
-                            next_mem.waiting = true;
-                            c->stats.mem_stall++;
-                            mem_advances = false;
-                        } else {
-                            if (inst->op == OP_LW) {
-                                next_mem.load_value = cache_read(&c->cache, c->mem.mem_addr);
-                                next_wb.valid = true;
-                                next_wb.inst = *inst;
-                                next_wb.value = next_mem.load_value;
-                                next_mem.valid = false;
-                                mem_advances = true;
-                            } else {
-                                cache_write(&c->cache, c->mem.mem_addr, c->mem.store_data);
-                                if (state == MESI_E)
-                                    c->cache.state[cache_index(c->mem.mem_addr)] = MESI_M;
-                                next_wb.valid = true;
-                                next_wb.inst = *inst;
-                                next_wb.value = 0;
-                                next_mem.valid = false;
-                                mem_advances = true;
-                            }
-                        }
-                    } else {
-                        next_wb.valid = true;
-                        next_wb.inst = *inst;
-                        next_wb.value = c->mem.alu_result;
-                        next_mem.valid = false;
-                        mem_advances = true;
-                    }
-                }
-            }
+    // outputs, one file per job: memout, then regout, dsram, tsram and stats of every core
+    OutputQueue q;
+    q.sim = sim;
+    q.files = files;
+    q.count = 1 + OUTPUTS_PER_CORE * (uint32_t)n;
+    q.next = 0;
+    int helpers = sim->dump_threads;
+    if ((uint32_t)helpers > q.count - 1)
+        helpers = (int)q.count - 1;
+    SimThread threads[DUMP_THREADS_MAX];
+    for (int i = 0; i < helpers; i++)
+        thread_start(&threads[i], output_worker, &q);
+    output_worker(&q);
+    for (int i = 0; i < helpers; i++)
+        thread_join(threads[i]);
+    if (sim->profile && sim->opt.profile_prefix)
+        write_profile(sim, files);
+    if (sim->bus_stats && sim->opt.bus_window)
+        write_bus_stats(sim, files);
+    if (sim->l2_store)
+        write_l2(sim, files);
+}
 
-            bool mem_free_next = (!c->mem.valid) || mem_advances;
-            bool exec_can_move = c->exec.valid && mem_free_next;
-            bool exec_free_next = (!c->exec.valid) || exec_can_move;
-
-            // EXEC stage: execute ALU or compute addresses, then hand to MEM
-            if (c->exec.valid && exec_can_move) {
-                Instruction *inst = &c->exec.inst;
-                next_exec.valid = false;
-                next_mem.valid = true;
-                next_mem.inst = *inst;
-                next_mem.waiting = false;
-                next_mem.request_queued = false;
-                next_mem.miss = false;
-                next_mem.load_value = 0;
-                next_mem.alu_result = 0;
-                if (inst->op == OP_LW || inst->op == OP_SW) {
-                    uint32_t addr = (uint32_t)(c->exec.rs_val + c->exec.rt_val);
-                    next_mem.mem_addr = addr & ((1 << 20) - 1);
-                    next_mem.store_data = c->exec.rd_val;
-                    next_mem.is_load = (inst->op == OP_LW);
-                    next_mem.is_store = (inst->op == OP_SW);
-                } else {
-                    next_mem.is_load = next_mem.is_store = false;
-                    next_mem.alu_result = perform_alu(inst, c->exec.rs_val, c->exec.rt_val);
-                }
-            }
+static void sim_start(Simulator *sim, const char **files) {
+    sim_reset(sim);
+    sim_load(sim, files);
+    const char *ckpt = sim->opt.checkpoint_path;
+    if (ckpt && (ckpt[0] == '/' || ckpt[0] == '\\' || (ckpt[0] && ckpt[1] == ':')))
+        snprintf(sim->checkpoint_path, RUN_PATH_MAX, "%s", ckpt);
+    else if (ckpt)
+        shared_output_path(sim, files, ckpt, sim->checkpoint_path); // one file per run directory in -batch
+    if (sim->opt.restore_path)
+        restore_checkpoint(sim, sim->opt.restore_path);
+    if (sim->trace_armed && sim->opt.trigger_pc >= 0)
+        trace_check_pc(sim, sim->cycle);
+}
 
-            // DECODE stage: hazard detection (no forwarding) + branch resolution
-            bool decode_has_inst = c->decode.valid;
-            bool decode_stall = false;
-            if (decode_has_inst) {
-                c->regs[1] = c->decode.inst.imm;
-                int srcs[3];
-                int src_count = 0;
-                source_regs(&c->decode.inst, srcs, &src_count);
-                for (int s = 0; s < src_count; s++) {
-                    int reg = srcs[s];
-                    if (reg <= 1)
-                        continue;
-                    // No forwarding: any in-flight writer to the same reg forces a stall
-                    if (c->exec.valid && dest_reg(&c->exec.inst) == reg)
-                        decode_stall = true;
-                    if (c->mem.valid && dest_reg(&c->mem.inst) == reg)
-                        decode_stall = true;
-                    if (c->wb.valid && dest_reg(&c->wb.inst) == reg)
-                        decode_stall = true;
-                }
-                if (!exec_free_next)
-                    decode_stall = true;
-                if (decode_stall)
-                    c->stats.decode_stall++;
-            }
+static void sim_execute(Simulator *sim) {
+    if (sim->opt.sampled)
+        sim_run_sampled(sim);
+    else if (sim->opt.threaded)
+        sim_run_threaded(sim);
+    else
+        sim_run(sim);
+}
 
-            bool decode_moves = decode_has_inst && !decode_stall && exec_free_next;
-            bool decode_free_next = (!c->decode.valid) || decode_moves;
-            bool fetch_moves = c->fetch.valid && decode_free_next;
-
-            if (decode_moves) {
-                Instruction *inst = &c->decode.inst;
-                next_exec.valid = true;
-                next_exec.inst = *inst;
-                next_exec.rs_val = c->regs[inst->rs];
-                next_exec.rt_val = c->regs[inst->rt];
-                next_exec.rd_val = c->regs[inst->rd];
-
-                // Branch/jump resolve in decode; delay slot is the following instruction already in fetch
-                if (inst->op >= OP_BEQ && inst->op <= OP_BGE) {
-                    bool taken = perform_compare(inst, next_exec.rs_val, next_exec.rt_val);
-                    if (debug_branch && c->id == 3) {
-                        fprintf(stderr, "cycle %d core%d branch pc %03X rs=%08X rt=%08X taken=%d target=%03X\n",
-                                cycle, c->id, inst->pc & 0x3FF, (uint32_t)next_exec.rs_val, (uint32_t)next_exec.rt_val,
-                                taken, c->regs[inst->rd] & 0x3FF);
-                    }
-                    if (taken) {
-                        c->redirect_pending = true;
-                        c->redirect_pc = c->regs[inst->rd] & 0x3FF;
-                    }
-                } else if (inst->op == OP_JAL) {
-                    c->redirect_pending = true;
-                    c->redirect_pc = c->regs[inst->rd] & 0x3FF;
-                }
+static void simulate(Simulator *sim, const char **files) {
+    sim_start(sim, files);
+    sim_execute(sim);
+    sim_finish(sim, files);
+}
 
-                // R1 always mirrors the current instruction immediate (decoded in this cycle)
-                c->regs[1] = inst->imm;
-                next_decode.valid = false;
-            } else if (!decode_stall) {
-                next_decode.valid = false;
-            }
+// ---------- Batch mode ----------
 
-            if (fetch_moves) {
-                next_decode.valid = true;
-                next_decode.inst = c->fetch.inst;
-            }
+typedef struct {
+    // Run directories from the manifest; workers claim them in order through `next`
+    char **dirs;
+    uint32_t count;
+    volatile uint32_t next;
+    const MachineConfig *cfg;
+} BatchQueue;
 
-            // FETCH stage: pull next instruction unless halted or decode is blocked
-            if (!c->stop_fetch && decode_free_next) {
-                if (c->redirect_pending) {
-                    // branch/jump taken: fetch target while delay slot advances
-                    Instruction inst = decode_inst(c->imem[c->redirect_pc], c->redirect_pc);
-                    next_fetch.valid = true;
-                    next_fetch.inst = inst;
-                    c->pc = (c->redirect_pc + 1) & (IMEM_SIZE - 1);
-                    c->redirect_pending = false;
-                } else {
-                    Instruction inst = decode_inst(c->imem[c->pc], c->pc);
-                    next_fetch.valid = true;
-                    next_fetch.inst = inst;
-                    if (inst.op == OP_HALT)
-                        c->stop_fetch = true;
-                    c->pc = (c->pc + 1) & (IMEM_SIZE - 1);
-                }
-            } else if (fetch_moves) {
-                next_fetch.valid = false;
-            }
+static void batch_worker(void *arg) {
+    // One simulator per worker, reused for every run it claims
+    BatchQueue *q = (BatchQueue *)arg;
+    Simulator *sim = sim_alloc(q->cfg);
+    sim->dump_threads = 0; // the other workers already keep the host busy
+    char (*paths)[RUN_PATH_MAX] = alloc_run_paths();
+    const char *files[RUN_FILES_MAX];
+    while (1) {
+        uint32_t i = atomic_fetch_add_u32(&q->next, 1);
+        if (i >= q->count)
+            break;
+        run_paths(q->dirs[i], q->cfg->num_cores, paths, files);
+        simulate(sim, files);
+    }
+    free(paths);
+    sim_free(sim);
+}
 
-            c->wb = next_wb;
-            c->mem = next_mem;
-            c->exec = next_exec;
-            c->decode = next_decode;
-            c->fetch = next_fetch;
-
-            bool any_valid = c->fetch.valid || c->decode.valid || c->exec.valid || c->mem.valid || c->wb.valid;
-            if (c->halted && !any_valid)
-                c->done = true;
-        }
-
-        // start bus transaction if idle
-        if (bus.phase == 0) {
-            int chosen = -1;
-            for (int k = 0; k < NUM_CORES; k++) {
-                int idx = (rr_next + k) % NUM_CORES;
-                if (requests[idx].active) {
-                    chosen = idx;
-                    break;
-                }
-            }
-            if (chosen != -1) {
-                rr_next = (chosen + 1) % NUM_CORES;
-                BusRequest req = requests[chosen];
-                requests[chosen].active = false;
-                // Round-robin winner starts transaction; others will retry next cycle
-                start_bus_transaction(&bus, &req, cores, main_mem);
-            }
+static char **read_manifest(const char *path, uint32_t *count) {
+    // One run directory per line; blank lines and # comments are skipped
+    FILE *fp = fopen(path, "rt");
+    if (!fp) {
+        fprintf(stderr, "Failed to open %s\n", path);
+        exit(1);
+    }
+    char **dirs = NULL;
+    uint32_t n = 0, cap = 0;
+    char line[RUN_PATH_MAX];
+    while (fgets(line, sizeof(line), fp)) {
+        char *p = line;
+        while (*p == ' ' || *p == '\t')
+            p++;
+        size_t len = strlen(p);
+        while (len > 0 && (p[len - 1] == '\n' || p[len - 1] == '\r' || p[len - 1] == ' ' || p[len - 1] == '\t'))
+            p[--len] = 0;
+        if (len == 0 || p[0] == '#')
+            continue;
+        if (n == cap) {
+            cap = cap ? cap * 2 : 64;
+            dirs = (char **)realloc(dirs, cap * sizeof(char *));
         }
+        char *copy = (char *)malloc(len + 1);
+        if (!dirs || !copy) {
+            fprintf(stderr, "Failed to allocate manifest\n");
+            exit(1);
+        }
+        memcpy(copy, p, len + 1);
+        dirs[n++] = copy;
+    }
+    fclose(fp);
+    *count = n;
+    return dirs;
+}
 
-        // determine bus output for this cycle (flush beats waiting)
-        if (bus.phase == 2) {
-            bus.bus_cmd_out = BUS_FLUSH;
-            bus.bus_origid_out = bus.provider;
-            bus.bus_addr_out = (bus.addr & ~(BLOCK_WORDS - 1)) + bus.index;
-            bus.bus_data_out = bus.block[bus.index];
-            bus.bus_shared_out = bus.shared;
-        } else if (bus.phase == 1 && bus.delay == 0 && bus.bus_cmd_out == BUS_NONE) {
-            bus.phase = 2;
-            bus.index = 0;
-            bus.bus_cmd_out = BUS_FLUSH;
-            bus.bus_origid_out = bus.provider;
-            bus.bus_addr_out = (bus.addr & ~(BLOCK_WORDS - 1)) + bus.index;
-            bus.bus_data_out = bus.block[bus.index];
-            bus.bus_shared_out = bus.shared;
-        }
-
-        write_bus_trace(bus_fp, cycle, &bus);
-
-        // advance bus state (latency countdown or streaming flush)
-        if (bus.phase == 1 && bus.delay > 0) {
-            bus.delay--;
-        } else if (bus.phase == 2 && bus.bus_cmd_out == BUS_FLUSH) {
-            bus.index++;
-            if (bus.index >= BLOCK_WORDS) {
-                complete_transaction(&bus, cores, main_mem);
-                bus.phase = 0;
-                bus.cmd = BUS_NONE;
-            }
+static int run_batch(const char *manifest, int jobs, const MachineConfig *cfg) {
+    BatchQueue q;
+    q.dirs = read_manifest(manifest, &q.count);
+    q.next = 0;
+    q.cfg = cfg;
+    if (jobs <= 0)
+        jobs = host_cpu_count();
+    if ((uint32_t)jobs > q.count)
+        jobs = (int)q.count;
+    SimThread *threads = (SimThread *)malloc((size_t)(jobs > 0 ? jobs : 1) * sizeof(SimThread));
+    if (!threads) {
+        fprintf(stderr, "Failed to allocate batch workers\n");
+        exit(1);
+    }
+    for (int i = 0; i < jobs; i++)
+        thread_start(&threads[i], batch_worker, &q);
+    for (int i = 0; i < jobs; i++)
+        thread_join(threads[i]);
+    free(threads);
+    for (uint32_t i = 0; i < q.count; i++)
+        free(q.dirs[i]);
+    free(q.dirs);
+    return 0;
+}
+
+static void usage(void) {
+    fprintf(stderr, "usage: sim.exe [machine flags] [imem0..N-1 memin memout regout0..N-1 core0..N-1trace bustrace dsram0..N-1 tsram0..N-1 stats0..N-1]\n");
+    fprintf(stderr, "       sim.exe [machine flags] -batch manifest.txt [-j workers]\n");
+    fprintf(stderr, "       sim.exe [machine flags] -bench [manifest.txt] [-n repetitions]\n");
+    fprintf(stderr, "machine flags: -cores N (1..%d, default %d) -lines N (default %d) -block N (default %d) -delay N (default %d)\n",
+            MAX_CORES, DEFAULT_CORES, DEFAULT_CACHE_LINES, DEFAULT_BLOCK_WORDS, DEFAULT_MEM_DELAY);
+    fprintf(stderr, "               -ways N (default 1) -policy lru|plru|random (default lru)\n");
+    fprintf(stderr, "               -bus-queue N (0 = atomic bus, default; 1..%d = split-transaction bus)\n", MAX_BUS_QUEUE);
+    fprintf(stderr, "               -cwf (critical word first with early restart) -forward (operand forwarding)\n");
+    fprintf(stderr, "               -store-buffer N (0 = off, default; 1..%d entries per core)\n", MAX_STORE_BUFFER);
+    fprintf(stderr, "               -prefetch none|next|stride (default none) -snoop-filter (probe recorded sharers only)\n");
+    fprintf(stderr, "               -l2 N (shared inclusive L2 lines, 0 = none, default) -l2-ways N (default %d) -l2-delay N (default %d)\n",
+            DEFAULT_L2_WAYS, DEFAULT_L2_DELAY);
+    fprintf(stderr, "               lines, block and ways are powers of two; with no file list the default names are used\n");
+}
+
+static bool check_machine_config(const MachineConfig *cfg) {
+    int index_bits = log2_exact(cfg->cache_lines);
+    int offset_bits = log2_exact(cfg->block_words);
+    if (cfg->num_cores < 1 || cfg->num_cores > MAX_CORES) {
+        fprintf(stderr, "-cores must be between 1 and %d\n", MAX_CORES);
+        return false;
+    }
+    if (offset_bits < 0 || cfg->block_words > MAX_BLOCK_WORDS) {
+        fprintf(stderr, "-block must be a power of two up to %d\n", MAX_BLOCK_WORDS);
+        return false;
+    }
+    if (index_bits < 0 || index_bits + offset_bits > ADDR_BITS) {
+        fprintf(stderr, "-lines must be a power of two and lines * block at most 2^%d words\n", ADDR_BITS);
+        return false;
+    }
+    int way_bits = log2_exact(cfg->ways);
+    if (way_bits < 0 || cfg->ways > MAX_WAYS || cfg->ways > cfg->cache_lines) {
+        fprintf(stderr, "-ways must be a power of two up to %d and at most -lines\n", MAX_WAYS);
+        return false;
+    }
+    if (cfg->policy < 0) {
+        fprintf(stderr, "-policy must be lru, plru or random\n");
+        return false;
+    }
+    if (cfg->prefetch < 0) {
+        fprintf(stderr, "-prefetch must be none, next or stride\n");
+        return false;
+    }
+    if (cfg->bus_queue < 0 || cfg->bus_queue > MAX_BUS_QUEUE) {
+        fprintf(stderr, "-bus-queue must be between 0 and %d\n", MAX_BUS_QUEUE);
+        return false;
+    }
+    if (cfg->store_buffer < 0 || cfg->store_buffer > MAX_STORE_BUFFER) {
+        fprintf(stderr, "-store-buffer must be between 0 and %d\n", MAX_STORE_BUFFER);
+        return false;
+    }
+    if (cfg->mem_delay < 0) {
+        fprintf(stderr, "-delay must not be negative\n");
+        return false;
+    }
+    if (cfg->l2_lines) {
+        int l2_index_bits = log2_exact(cfg->l2_lines);
+        if (l2_index_bits < 0 || l2_index_bits + offset_bits > ADDR_BITS) {
+            fprintf(stderr, "-l2 must be 0 or a power of two and l2 lines * block at most 2^%d words\n", ADDR_BITS);
+            return false;
+        }
+        if (log2_exact(cfg->l2_ways) < 0 || cfg->l2_ways > MAX_WAYS || cfg->l2_ways > cfg->l2_lines) {
+            fprintf(stderr, "-l2-ways must be a power of two up to %d and at most -l2\n", MAX_WAYS);
+            return false;
         }
+        if (cfg->l2_delay < 0) {
+            fprintf(stderr, "-l2-delay must not be negative\n");
+            return false;
+        }
+    }
+    return true;
+}
+
+static void default_machine_config(MachineConfig *cfg) {
+    memset(cfg, 0, sizeof(*cfg)); // padding too, so checkpoints can compare configs bytewise
+    cfg->num_cores = DEFAULT_CORES;
+    cfg->cache_lines = DEFAULT_CACHE_LINES;
+    cfg->block_words = DEFAULT_BLOCK_WORDS;
+    cfg->mem_delay = DEFAULT_MEM_DELAY;
+    cfg->ways = 1;
+    cfg->policy = REPL_LRU;
+    cfg->bus_queue = 0;
+    cfg->store_buffer = 0;
+    cfg->prefetch = PREFETCH_NONE;
+    cfg->critical_word_first = false;
+    cfg->forwarding = false;
+    cfg->snoop_filter = false;
+    cfg->l2_lines = 0;
+    cfg->l2_ways = DEFAULT_L2_WAYS;
+    cfg->l2_delay = DEFAULT_L2_DELAY;
+}
 
-        if (max_cycles >= 0 && cycle >= max_cycles) {
+static int parse_machine_flags(int argc, char **argv, MachineConfig *cfg) {
+    // Leading "-flag value" pairs; returns the index of the first other argument, or -1 on error
+    default_machine_config(cfg);
+    int i = 1;
+    while (i < argc) {
+        bool *toggle = NULL;
+        if (strcmp(argv[i], "-cwf") == 0)
+            toggle = &cfg->critical_word_first;
+        else if (strcmp(argv[i], "-forward") == 0)
+            toggle = &cfg->forwarding;
+        else if (strcmp(argv[i], "-snoop-filter") == 0)
+            toggle = &cfg->snoop_filter;
+        if (toggle) {
+            *toggle = true;
+            i++;
+            continue;
+        }
+        if (i + 1 >= argc)
             break;
+        if (strcmp(argv[i], "-policy") == 0) {
+            const char *name = argv[i + 1];
+            cfg->policy = strcmp(name, "lru") == 0 ? REPL_LRU
+                        : strcmp(name, "plru") == 0 ? REPL_PLRU
+                        : strcmp(name, "random") == 0 ? REPL_RANDOM : -1;
+            i += 2;
+            continue;
         }
-
-        bool all_done = true;
-        for (int i = 0; i < NUM_CORES; i++) {
-            if (!cores[i].done)
-                all_done = false;
+        if (strcmp(argv[i], "-prefetch") == 0) {
+            const char *name = argv[i + 1];
+            cfg->prefetch = strcmp(name, "none") == 0 ? PREFETCH_NONE
+                          : strcmp(name, "next") == 0 ? PREFETCH_NEXT
+                          : strcmp(name, "stride") == 0 ? PREFETCH_STRIDE : -1;
+            i += 2;
+            continue;
         }
-        if (all_done && bus.phase == 0)
+        int *field = NULL;
+        if (strcmp(argv[i], "-cores") == 0)
+            field = &cfg->num_cores;
+        else if (strcmp(argv[i], "-lines") == 0)
+            field = &cfg->cache_lines;
+        else if (strcmp(argv[i], "-block") == 0)
+            field = &cfg->block_words;
+        else if (strcmp(argv[i], "-delay") == 0)
+            field = &cfg->mem_delay;
+        else if (strcmp(argv[i], "-ways") == 0)
+            field = &cfg->ways;
+        else if (strcmp(argv[i], "-bus-queue") == 0)
+            field = &cfg->bus_queue;
+        else if (strcmp(argv[i], "-store-buffer") == 0)
+            field = &cfg->store_buffer;
+        else if (strcmp(argv[i], "-l2") == 0)
+            field = &cfg->l2_lines;
+        else if (strcmp(argv[i], "-l2-ways") == 0)
+            field = &cfg->l2_ways;
+        else if (strcmp(argv[i], "-l2-delay") == 0)
+            field = &cfg->l2_delay;
+        else
             break;
+        *field = atoi(argv[i + 1]);
+        i += 2;
+    }
+    return check_machine_config(cfg) ? i : -1;
+}
+
+// ---------- Benchmark mode ----------
+
+#define BENCH_DEFAULT_REPS 5
+
+static const char *const bench_default_dirs[] = {"counter", "mulserial", "mulparallel", "example_221125_win"};
+
+// Holds the course reference outputs, which this simulator does not reproduce: in the default set its
+// mismatches are reported as "reference" and do not fail the benchmark
+#define BENCH_REFERENCE_DIR "example_221125_win"
 
-        cycle++;
+typedef struct {
+    // One workload in one trace mode; phase times are the best over the repetitions, in seconds
+    double load;
+    double simulate;
+    double dump;
+    uint64_t cycles;
+    uint64_t instructions;
+    const char *memout; // "ok", "differs", "missing" (no golden file), "skipped" or "reference"
+    const char *stats;
+    const char *engines; // busstats.json of the serial and threaded engines: "ok", "differs", "missing", "skipped"
+} BenchResult;
+
+static const char *compare_golden(const char *path, const char *golden) {
+    // Text comparison that ignores CR bytes, so the CRLF goldens written on Windows match
+    FILE *b = fopen(golden, "rb");
+    if (!b)
+        return "missing";
+    FILE *a = fopen(path, "rb");
+    int ca = EOF, cb = EOF;
+    if (a) {
+        do {
+            do
+                ca = getc(a);
+            while (ca == '\r');
+            do
+                cb = getc(b);
+            while (cb == '\r');
+        } while (ca == cb && ca != EOF);
+        fclose(a);
     }
+    fclose(b);
+    return (a && ca == cb) ? "ok" : "differs";
+}
 
-    // Close trace files
-    for (int i = 0; i < NUM_CORES; i++) {
-        if (cores[i].trace_fp)
-            fclose(cores[i].trace_fp);
+static const char *compare_golden_stats(const char **files, const char **golden, int n) {
+    for (int i = 0; i < n; i++) {
+        const char *r = compare_golden(files[run_file_index(RUN_STATS, n, i)], golden[run_file_index(RUN_STATS, n, i)]);
+        if (strcmp(r, "ok") != 0)
+            return r;
     }
-    if (bus_fp)
-        fclose(bus_fp);
+    return "ok";
+}
 
-    // Write back all dirty cache lines to main memory before dumping outputs
-    for (int c = 0; c < NUM_CORES; c++) {
-        for (int idx = 0; idx < CACHE_LINES; idx++) {
-            writeback_line(&cores[c].cache, idx, main_mem);
-        }
+static const char *bench_scratch_dir(void) {
+    // Outputs of the benchmark runs go to the host temp directory, never over the goldens
+    const char *names[] = {"TMPDIR", "TEMP", "TMP"};
+    for (int i = 0; i < 3; i++) {
+        const char *dir = getenv(names[i]);
+        if (dir && *dir)
+            return dir;
     }
+#ifdef _WIN32
+    return ".";
+#else
+    return "/tmp";
+#endif
+}
+
+static void bench_run(Simulator *sim, const char **files, const char **golden, int reps, bool check_stats,
+                      BenchResult *r) {
+    int n = sim->cfg.num_cores;
+    for (int rep = 0; rep < reps; rep++) {
+        double t0 = host_seconds();
+        sim_start(sim, files);
+        double t1 = host_seconds();
+        sim_execute(sim);
+        double t2 = host_seconds();
+        sim_finish(sim, files);
+        double t3 = host_seconds();
+        if (rep == 0 || t1 - t0 < r->load)
+            r->load = t1 - t0;
+        if (rep == 0 || t2 - t1 < r->simulate)
+            r->simulate = t2 - t1;
+        if (rep == 0 || t3 - t2 < r->dump)
+            r->dump = t3 - t2;
+    }
+    // Every repetition does the same work, so the last one stands for all of them
+    r->cycles = 0;
+    r->instructions = 0;
+    for (int i = 0; i < n; i++) {
+        const Stats *s = &sim->cores[i].stats;
+        if (s->cycles > r->cycles)
+            r->cycles = s->cycles;
+        r->instructions += (uint64_t)s->instructions + s->functional_instructions;
+    }
+    r->memout = compare_golden(files[run_file_index(RUN_MEMOUT, n, 0)], golden[run_file_index(RUN_MEMOUT, n, 0)]);
+    r->stats = check_stats ? compare_golden_stats(files, golden, n) : "skipped";
+}
+
+static const char *bench_cross_engine(Simulator *sim, const char **files) {
+    // With SIM_BUS_STATS, runs once more on the other engine (serial or SIM_THREADED) and compares busstats.json,
+    // whose post and grant cycles are the first thing to drift if the threaded engine replays the bus wrongly
+    if (!sim->opt.bus_window || sim->opt.sampled)
+        return "skipped";
+    char path[RUN_PATH_MAX];
+    char ref[RUN_PATH_MAX];
+    shared_output_path(sim, files, "busstats.json", path);
+    shared_output_path(sim, files, "busstats.ref.json", ref);
+    remove(ref);
+    if (rename(path, ref) != 0)
+        return "missing";
+    sim_start(sim, files);
+    sim->opt.threaded = !sim->opt.threaded; // sim_reset reads the environment again on the next run
+    sim_execute(sim);
+    sim_finish(sim, files);
+    const char *r = compare_golden(path, ref);
+    remove(ref);
+    return r;
+}
+
+static void json_string(FILE *fp, const char *s) {
+    fputc('"', fp);
+    for (; *s; s++) {
+        if (*s == '"' || *s == '\\')
+            fputc('\\', fp);
+        fputc(*s, fp);
+    }
+    fputc('"', fp);
+}
+
+static double per_second(uint64_t count, double seconds) {
+    return seconds > 0 ? (double)count / seconds : 0;
+}
 
-    // outputs
-    write_trimmed_mem(files[5], main_mem, MAIN_MEM_WORDS);
-    for (int i = 0; i < NUM_CORES; i++) {
-        write_regout(files[6 + i], cores[i].regs);
+static int run_bench(const char *manifest, int reps, const MachineConfig *cfg) {
+    // Times load, simulate and dump for every workload with and without traces, checks memout and stats
+    // against the files already in the run directory, and prints the results as JSON on stdout
+    char **owned = NULL;
+    uint32_t count = sizeof(bench_default_dirs) / sizeof(bench_default_dirs[0]);
+    const char *const *dirs = bench_default_dirs;
+    if (manifest) {
+        owned = read_manifest(manifest, &count);
+        dirs = (const char *const *)owned;
     }
-    for (int i = 0; i < NUM_CORES; i++) {
-        write_full_mem(files[15 + i], cores[i].cache.data, CACHE_WORDS);
-        // tsram: MESI in 13:12, tag in 11:0
-        uint32_t tsram[CACHE_LINES];
-        for (int j = 0; j < CACHE_LINES; j++) {
-            tsram[j] = ((uint32_t)cores[i].cache.state[j] << 12) | (cores[i].cache.tag[j] & 0xFFF);
+    // The goldens are stats of the default machine in the detailed engine; other setups only check memout
+    MachineConfig stock;
+    default_machine_config(&stock);
+    SimOptions opt;
+    read_options(&opt);
+    bool check_stats = memcmp(cfg, &stock, sizeof(stock)) == 0 && !opt.sampled && opt.max_cycles < 0 &&
+                       !opt.restore_path;
+
+    int n = cfg->num_cores;
+    Simulator *sim = sim_alloc(cfg);
+    char (*golden_paths)[RUN_PATH_MAX] = alloc_run_paths();
+    char (*out_paths)[RUN_PATH_MAX] = alloc_run_paths();
+    const char *golden[RUN_FILES_MAX];
+    const char *files[RUN_FILES_MAX];
+    run_paths(bench_scratch_dir(), n, out_paths, files);
+    bool failed = false;
+
+    printf("{\n  \"reps\": %d,\n  \"cores\": %d,\n  \"runs\": [", reps, n);
+    for (uint32_t d = 0; d < count; d++) {
+        run_paths(dirs[d], n, golden_paths, golden);
+        for (int i = 0; i < n; i++)
+            files[run_file_index(RUN_IMEM, n, i)] = golden[run_file_index(RUN_IMEM, n, i)];
+        files[run_file_index(RUN_MEMIN, n, 0)] = golden[run_file_index(RUN_MEMIN, n, 0)];
+        for (int traced = 1; traced >= 0; traced--) {
+            // A trace file that cannot be created is skipped, so an empty name turns tracing off
+            for (int i = 0; i < n; i++) {
+                int k = run_file_index(RUN_CORETRACE, n, i);
+                files[k] = traced ? out_paths[k] : "";
+            }
+            int k = run_file_index(RUN_BUSTRACE, n, 0);
+            files[k] = traced ? out_paths[k] : "";
+
+            BenchResult r;
+            bench_run(sim, files, golden, reps, check_stats, &r);
+            r.engines = traced ? "skipped" : bench_cross_engine(sim, files);
+            if (!manifest && strcmp(dirs[d], BENCH_REFERENCE_DIR) == 0) {
+                if (strcmp(r.memout, "differs") == 0)
+                    r.memout = "reference";
+                if (strcmp(r.stats, "differs") == 0)
+                    r.stats = "reference";
+            }
+            failed |= strcmp(r.memout, "differs") == 0 || strcmp(r.stats, "differs") == 0 ||
+                      strcmp(r.engines, "differs") == 0;
+            printf("%s\n    {\"dir\": ", (d == 0 && traced) ? "" : ",");
+            json_string(stdout, dirs[d]);
+            printf(", \"trace\": %s, \"cycles\": %llu, \"instructions\": %llu, \"load_s\": %.6f, \"simulate_s\": %.6f, "
+                   "\"dump_s\": %.6f, \"cycles_per_s\": %.0f, \"instructions_per_s\": %.0f, \"memout\": \"%s\", "
+                   "\"stats\": \"%s\", \"engines\": \"%s\"}",
+                   traced ? "true" : "false", (unsigned long long)r.cycles, (unsigned long long)r.instructions,
+                   r.load, r.simulate, r.dump, per_second(r.cycles, r.simulate),
+                   per_second(r.instructions, r.simulate), r.memout, r.stats, r.engines);
+            fprintf(stderr, "%s%s: %llu cycles, load %.4f s, simulate %.4f s (%.2f Mcycles/s), dump %.4f s, "
+                            "memout %s, stats %s, engines %s\n",
+                    dirs[d], traced ? "" : " (no trace)", (unsigned long long)r.cycles, r.load, r.simulate,
+                    per_second(r.cycles, r.simulate) * 1e-6, r.dump, r.memout, r.stats, r.engines);
         }
-        write_full_mem(files[19 + i], tsram, CACHE_LINES);
     }
-    for (int i = 0; i < NUM_CORES; i++) {
-        write_stats(files[23 + i], &cores[i].stats);
+    printf("\n  ],\n  \"passed\": %s\n}\n", failed ? "false" : "true");
+
+    free(out_paths);
+    free(golden_paths);
+    sim_free(sim);
+    if (owned) {
+        for (uint32_t i = 0; i < count; i++)
+            free(owned[i]);
+        free(owned);
     }
+    return failed ? 1 : 0;
 }
 
 int main(int argc, char **argv) {
-    const char *defaults[27] = {
-        "imem0.txt", "imem1.txt", "imem2.txt", "imem3.txt",
-        "memin.txt", "memout.txt",
-        "regout0.txt", "regout1.txt", "regout2.txt", "regout3.txt",
-        "core0trace.txt", "core1trace.txt", "core2trace.txt", "core3trace.txt",
-        "bustrace.txt",
-        "dsram0.txt", "dsram1.txt", "dsram2.txt", "dsram3.txt",
-        "tsram0.txt", "tsram1.txt", "tsram2.txt", "tsram3.txt",
-        "stats0.txt", "stats1.txt", "stats2.txt", "stats3.txt"
-    };
-
-    const char *files[27];
-    if (argc == 1) {
-        for (int i = 0; i < 27; i++)
-            files[i] = defaults[i];
-    } else if (argc == 28) {
-        for (int i = 0; i < 27; i++)
-            files[i] = argv[i + 1];
-    } else {
-        fprintf(stderr, "usage: sim.exe imem0.txt imem1.txt imem2.txt imem3.txt memin.txt memout.txt regout0.txt regout1.txt regout2.txt regout3.txt core0trace.txt core1trace.txt core2trace.txt core3trace.txt bustrace.txt dsram0.txt dsram1.txt dsram2.txt dsram3.txt tsram0.txt tsram1.txt tsram2.txt tsram3.txt stats0.txt stats1.txt stats2.txt stats3.txt\n");
+    MachineConfig cfg;
+    int first = parse_machine_flags(argc, argv, &cfg);
+    if (first < 0) {
+        usage();
         return 1;
     }
+    argc -= first - 1;
+    argv += first - 1;
 
-    uint32_t *main_mem = (uint32_t *)calloc(MAIN_MEM_WORDS, sizeof(uint32_t));
-    if (!main_mem) {
-        fprintf(stderr, "Failed to allocate main memory\n");
-        return 1;
+    if (argc >= 3 && strcmp(argv[1], "-batch") == 0) {
+        int jobs = 0;
+        if (argc == 5 && strcmp(argv[3], "-j") == 0) {
+            jobs = atoi(argv[4]);
+        } else if (argc != 3) {
+            usage();
+            return 1;
+        }
+        return run_batch(argv[2], jobs, &cfg);
+    }
+
+    if (argc >= 2 && strcmp(argv[1], "-bench") == 0) {
+        const char *manifest = NULL;
+        int reps = BENCH_DEFAULT_REPS;
+        int i = 2;
+        if (i < argc && argv[i][0] != '-')
+            manifest = argv[i++];
+        if (i + 1 < argc && strcmp(argv[i], "-n") == 0) {
+            reps = atoi(argv[i + 1]);
+            i += 2;
+        }
+        if (i != argc || reps < 1) {
+            usage();
+            return 1;
+        }
+        return run_bench(manifest, reps, &cfg);
     }
 
-    simulate(files, main_mem);
+    int count = run_file_count(cfg.num_cores);
+    const char *files[RUN_FILES_MAX];
+    char (*paths)[RUN_PATH_MAX] = alloc_run_paths();
+    if (argc == 1) {
+        run_paths("", cfg.num_cores, paths, files);
+    } else if (argc == count + 1) {
+        for (int i = 0; i < count; i++)
+            files[i] = argv[i + 1];
+    } else {
+        free(paths);
+        usage();
+        return 1;
+    }
 
-    free(main_mem);
+    Simulator *sim = sim_alloc(&cfg);
+    simulate(sim, files);
+    sim_free(sim);
+    free(paths);
     return 0;
 }
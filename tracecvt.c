@@ -0,0 +1,125 @@
+// Converts binary traces written with SIM_TRACE_FORMAT=binary back to the coreNtrace.txt / bustrace.txt text form.
+// usage: tracecvt in_trace out_trace.txt
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "tracefmt.h"
+
+#define OUT_BUFFER_BYTES (1 << 20)
+
+static char out_buf[OUT_BUFFER_BYTES];
+static size_t out_len;
+
+static void out_flush(FILE *fp) {
+    fwrite(out_buf, 1, out_len, fp);
+    out_len = 0;
+}
+
+static char *out_reserve(FILE *fp) {
+    if (out_len + TRACE_LINE_MAX > OUT_BUFFER_BYTES)
+        out_flush(fp);
+    return out_buf + out_len;
+}
+
+static int truncated(const char *path) {
+    fprintf(stderr, "%s: truncated trace record\n", path);
+    return 1;
+}
+
+static int convert_core(FILE *in, FILE *out, const char *path) {
+    CoreTraceRow row;
+    memset(&row, 0, sizeof(row));
+    uint8_t rec[TRACE_CORE_RECORD_BYTES];
+    uint8_t vals[4 * TRACE_REGS];
+    while (1) {
+        size_t got = fread(rec, 1, sizeof(rec), in);
+        if (got == 0)
+            break;
+        if (got != sizeof(rec))
+            return truncated(path);
+        row.cycle = trace_get_u32(rec);
+        for (int s = 0; s < TRACE_STAGES; s++)
+            row.pc[s] = trace_get_u16(rec + 4 + 2 * s);
+        uint16_t mask = trace_get_u16(rec + 14);
+        int changed = 0;
+        for (int i = 0; i < TRACE_REGS; i++)
+            changed += (mask >> i) & 1;
+        if (fread(vals, 4, (size_t)changed, in) != (size_t)changed)
+            return truncated(path);
+        const uint8_t *v = vals;
+        for (int i = 0; i < TRACE_REGS; i++) {
+            if (mask & (1u << i)) {
+                row.regs[i] = trace_get_u32(v);
+                v += 4;
+            }
+        }
+        out_len += trace_format_core_row(&row, out_reserve(out));
+    }
+    return 0;
+}
+
+static int convert_bus(FILE *in, FILE *out, const char *path) {
+    uint8_t rec[TRACE_BUS_RECORD_BYTES];
+    while (1) {
+        size_t got = fread(rec, 1, sizeof(rec), in);
+        if (got == 0)
+            break;
+        if (got != sizeof(rec))
+            return truncated(path);
+        BusTraceRow row;
+        row.cycle = trace_get_u32(rec);
+        row.origid = rec[4];
+        row.cmd = rec[5];
+        row.shared = rec[6];
+        row.addr = trace_get_u32(rec + 8);
+        row.data = trace_get_u32(rec + 12);
+        out_len += trace_format_bus_row(&row, out_reserve(out));
+    }
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    if (argc != 3) {
+        fprintf(stderr, "usage: tracecvt in_trace out_trace.txt\n");
+        return 1;
+    }
+    FILE *in = fopen(argv[1], "rb");
+    if (!in) {
+        fprintf(stderr, "Failed to open %s\n", argv[1]);
+        return 1;
+    }
+    uint8_t hdr[TRACE_HEADER_BYTES];
+    if (fread(hdr, 1, sizeof(hdr), in) != sizeof(hdr) || memcmp(hdr, TRACE_MAGIC, 8) != 0) {
+        fprintf(stderr, "%s is not a binary simulator trace\n", argv[1]);
+        fclose(in);
+        return 1;
+    }
+    if (trace_get_u16(hdr + 8) != TRACE_VERSION) {
+        fprintf(stderr, "%s: unsupported trace version %u\n", argv[1], trace_get_u16(hdr + 8));
+        fclose(in);
+        return 1;
+    }
+    FILE *out = fopen(argv[2], "wt");
+    if (!out) {
+        fprintf(stderr, "Failed to open %s for write\n", argv[2]);
+        fclose(in);
+        return 1;
+    }
+
+    int kind = trace_get_u16(hdr + 10);
+    int rc;
+    if (kind == TRACE_KIND_CORE) {
+        rc = convert_core(in, out, argv[1]);
+    } else if (kind == TRACE_KIND_BUS) {
+        rc = convert_bus(in, out, argv[1]);
+    } else {
+        fprintf(stderr, "%s: unknown trace kind %d\n", argv[1], kind);
+        rc = 1;
+    }
+    out_flush(out);
+    fclose(out);
+    fclose(in);
+    return rc;
+}
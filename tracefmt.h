@@ -0,0 +1,139 @@
+// Trace row layout shared by the simulator and the tracecvt converter.
+// Text lines match the coreNtrace.txt / bustrace.txt formats; the binary form is a 16-byte file header
+// followed by little-endian records (core rows carry only the registers that changed since the last row).
+#ifndef TRACEFMT_H
+#define TRACEFMT_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define TRACE_STAGES 5          // fetch, decode, exec, mem, wb
+#define TRACE_REGS 14           // R2-R15
+#define TRACE_PC_NONE 0xFFFF    // stage empty, printed as "---"
+
+#define TRACE_MAGIC "SIMTRACE"
+#define TRACE_VERSION 1
+#define TRACE_KIND_CORE 0
+#define TRACE_KIND_BUS 1
+#define TRACE_HEADER_BYTES 16
+#define TRACE_CORE_RECORD_BYTES 16  // cycle, 5 stage PCs, changed-register mask
+#define TRACE_CORE_RECORD_MAX (TRACE_CORE_RECORD_BYTES + 4 * TRACE_REGS)
+#define TRACE_BUS_RECORD_BYTES 16   // cycle, origid, cmd, shared, pad, addr, data
+#define TRACE_LINE_MAX 192
+
+typedef struct {
+    uint32_t cycle;
+    uint16_t pc[TRACE_STAGES];
+    uint32_t regs[TRACE_REGS];
+} CoreTraceRow;
+
+typedef struct {
+    uint32_t cycle;
+    uint32_t origid;
+    uint32_t cmd;
+    uint32_t addr;
+    uint32_t data;
+    uint32_t shared;
+} BusTraceRow;
+
+// ---------- Little-endian packing ----------
+
+static inline void trace_put_u16(uint8_t *p, uint16_t v) {
+    p[0] = (uint8_t)v;
+    p[1] = (uint8_t)(v >> 8);
+}
+
+static inline void trace_put_u32(uint8_t *p, uint32_t v) {
+    p[0] = (uint8_t)v;
+    p[1] = (uint8_t)(v >> 8);
+    p[2] = (uint8_t)(v >> 16);
+    p[3] = (uint8_t)(v >> 24);
+}
+
+static inline uint16_t trace_get_u16(const uint8_t *p) {
+    return (uint16_t)(p[0] | (p[1] << 8));
+}
+
+static inline uint32_t trace_get_u32(const uint8_t *p) {
+    return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static inline void trace_put_header(uint8_t *p, int kind) {
+    for (int i = 0; i < 8; i++)
+        p[i] = (uint8_t)TRACE_MAGIC[i];
+    trace_put_u16(p + 8, TRACE_VERSION);
+    trace_put_u16(p + 10, (uint16_t)kind);
+    trace_put_u32(p + 12, 0);
+}
+
+// ---------- Text formatting (printf-free, byte-identical to the original fprintf formats) ----------
+
+static inline char *trace_hex_fixed(char *out, uint32_t v, int digits) {
+    static const char hex[] = "0123456789ABCDEF";
+    for (int i = digits - 1; i >= 0; i--) {
+        out[i] = hex[v & 0xF];
+        v >>= 4;
+    }
+    return out + digits;
+}
+
+static inline char *trace_hex(char *out, uint32_t v, int min_digits) {
+    // "%0*X": at least min_digits, more if the value needs them
+    int digits = 1;
+    while (digits < 8 && (v >> (4 * digits)) != 0)
+        digits++;
+    if (digits < min_digits)
+        digits = min_digits;
+    return trace_hex_fixed(out, v, digits);
+}
+
+static inline char *trace_dec(char *out, uint32_t v) {
+    char tmp[10];
+    int n = 0;
+    do {
+        tmp[n++] = (char)('0' + v % 10);
+        v /= 10;
+    } while (v);
+    while (n)
+        *out++ = tmp[--n];
+    return out;
+}
+
+// "%d %03X|--- x5 %08X x14\n"
+static inline size_t trace_format_core_row(const CoreTraceRow *r, char *out) {
+    char *p = trace_dec(out, r->cycle);
+    for (int s = 0; s < TRACE_STAGES; s++) {
+        *p++ = ' ';
+        if (r->pc[s] == TRACE_PC_NONE) {
+            p[0] = p[1] = p[2] = '-';
+            p += 3;
+        } else {
+            p = trace_hex(p, r->pc[s] & 0x3FF, 3);
+        }
+    }
+    for (int i = 0; i < TRACE_REGS; i++) {
+        *p++ = ' ';
+        p = trace_hex_fixed(p, r->regs[i], 8);
+    }
+    *p++ = '\n';
+    return (size_t)(p - out);
+}
+
+// "%d %X %X %05X %08X %X\n"
+static inline size_t trace_format_bus_row(const BusTraceRow *r, char *out) {
+    char *p = trace_dec(out, r->cycle);
+    *p++ = ' ';
+    p = trace_hex(p, r->origid, 1);
+    *p++ = ' ';
+    p = trace_hex(p, r->cmd, 1);
+    *p++ = ' ';
+    p = trace_hex(p, r->addr & ((1u << 20) - 1), 5);
+    *p++ = ' ';
+    p = trace_hex_fixed(p, r->data, 8);
+    *p++ = ' ';
+    p = trace_hex(p, r->shared, 1);
+    *p++ = '\n';
+    return (size_t)(p - out);
+}
+
+#endif